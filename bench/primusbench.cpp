@@ -0,0 +1,300 @@
+// Synthetic load for measuring the primus pipeline: renders frames into one
+// or more windows through the given libGL and prints a JSON summary line
+#include <dlfcn.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <X11/Xlib.h>
+#include <GL/glx.h>
+
+#define die_if(cond, ...)  do {if (cond) {fprintf(stderr, "primusbench: " __VA_ARGS__); exit(1);} } while (0)
+
+// Entry points, resolved from the library under test
+static struct {
+#define FN(ret, name, args) ret (*name) args;
+#include "bench-fns.def"
+#undef FN
+  void load(const char *path)
+  {
+    void *handle = dlopen(path, RTLD_LAZY);
+    die_if(!handle, "failed to load %s: %s\n", path, dlerror());
+#define FN(ret, name, args) \
+    die_if(!(name = (ret (*) args)dlsym(handle, #name)), "%s is missing\n", #name);
+#include "bench-fns.def"
+#undef FN
+  }
+} gl;
+
+static double get_time(clockid_t clock)
+{
+  struct timespec tp;
+  clock_gettime(clock, &tp);
+  return tp.tv_sec + 1e-9 * tp.tv_nsec;
+}
+
+static double rusage_seconds(const struct timeval &tv)
+{
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// Draw a slowly changing gradient and a moving bar, so that part of each
+// frame changes and reduced color depth shows
+static void draw_frame(int frame, int width, int height)
+{
+  float t = (frame % 256) / 255.f, x = (frame % 120) / 60.f - 1;
+  gl.glViewport(0, 0, width, height);
+  gl.glClearColor(0, 0, 0, 1);
+  gl.glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  gl.glBegin(GL_QUADS);
+  gl.glColor3f(t, 0, 1 - t);
+  gl.glVertex2f(-1, -1);
+  gl.glColor3f(1, t, 0);
+  gl.glVertex2f(1, -1);
+  gl.glColor3f(0, 1, t);
+  gl.glVertex2f(1, 1);
+  gl.glColor3f(1 - t, 1 - t, 1 - t);
+  gl.glVertex2f(-1, 1);
+  gl.glEnd();
+  gl.glColor3f(1, 1, 1);
+  gl.glBegin(GL_QUADS);
+  gl.glVertex2f(x, -1);
+  gl.glVertex2f(x + 0.1f, -1);
+  gl.glVertex2f(x + 0.1f, 1);
+  gl.glVertex2f(x, 1);
+  gl.glEnd();
+}
+
+// Peak signal-to-noise ratio in dB of what the window shows against the frame
+// as rendered, which is read back before the swap.  Needs PRIMUS_SYNC=2, so
+// that the frame is on screen once glXSwapBuffers returns, and a 24-bit
+// TrueColor window.
+static double measure_psnr(Display *dpy, Window window, int width, int height)
+{
+  unsigned char *rendered = new unsigned char[width * height * 4];
+  gl.glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, rendered);
+  gl.glXSwapBuffers(dpy, window);
+  XSync(dpy, False);
+  XImage *image = XGetImage(dpy, window, 0, 0, width, height, AllPlanes, ZPixmap);
+  die_if(!image, "failed to get window contents\n");
+  double sse = 0;
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+    {
+      // Frames are stored bottom-up, images top-down
+      unsigned long p = XGetPixel(image, x, height - 1 - y);
+      const unsigned char *r = rendered + (y * width + x) * 4;
+      for (int c = 0; c < 3; c++)
+      {
+	double d = (double)((p >> (8 * c)) & 0xff) - r[c];
+	sse += d * d;
+      }
+    }
+  XDestroyImage(image);
+  delete[] rendered;
+  double mse = sse / (3.0 * width * height);
+  return mse > 0 ? 10 * log10(255 * 255 / mse) : 99;
+}
+
+// A window rendered from its own thread, connection and context, for -p
+struct RenderThread {
+  pthread_t thread;
+  int index, width, height, frames;
+  double duration;
+};
+
+static void *render_thread(void *arg)
+{
+  RenderThread &t = *(RenderThread *)arg;
+  Display *dpy = XOpenDisplay(NULL);
+  die_if(!dpy, "failed to open display\n");
+  int attrs[] = {GLX_RGBA, GLX_DOUBLEBUFFER, GLX_RED_SIZE, 8, GLX_GREEN_SIZE, 8, GLX_BLUE_SIZE, 8,
+		 GLX_DEPTH_SIZE, 24, None};
+  XVisualInfo *vis = gl.glXChooseVisual(dpy, DefaultScreen(dpy), attrs);
+  die_if(!vis, "no suitable visual\n");
+  Window root = RootWindow(dpy, vis->screen);
+  XSetWindowAttributes swa;
+  swa.colormap = XCreateColormap(dpy, root, vis->visual, AllocNone);
+  swa.border_pixel = 0;
+  Window window = XCreateWindow(dpy, root, 16 * t.index, 16 * t.index, t.width, t.height, 0, vis->depth,
+				InputOutput, vis->visual, CWColormap | CWBorderPixel, &swa);
+  XMapWindow(dpy, window);
+  XSync(dpy, False);
+  GLXContext ctx = gl.glXCreateContext(dpy, vis, NULL, True);
+  die_if(!ctx, "failed to create context\n");
+  gl.glXMakeCurrent(dpy, window, ctx);
+  double start = get_time(CLOCK_MONOTONIC);
+  for (t.frames = 0; get_time(CLOCK_MONOTONIC) - start < t.duration; t.frames++)
+  {
+    draw_frame(t.frames, t.width, t.height);
+    gl.glXSwapBuffers(dpy, window);
+  }
+  gl.glXMakeCurrent(dpy, None, NULL);
+  gl.glXDestroyContext(dpy, ctx);
+  XDestroyWindow(dpy, window);
+  XFree(vis);
+  XCloseDisplay(dpy);
+  return NULL;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+	  "usage: primusbench [options]\n"
+	  "  -l PATH   libGL to test (default: libGL.so.1)\n"
+	  "  -s WxH    window size (default: 1280x720)\n"
+	  "  -w N      number of windows rendered in turn (default: 1)\n"
+	  "  -p N      render N windows from N threads at once instead\n"
+	  "  -t SEC    duration (default: 6)\n"
+	  "  -r        resize windows continuously during the middle third\n"
+	  "  -c        switch to a context in another sharegroup halfway\n"
+	  "  -e        measure visual error of the last frame (needs PRIMUS_SYNC=2)\n"
+	  "  -n NAME   label for the report\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *lib = "libGL.so.1", *label = "";
+  int width = 1280, height = 720, nwindows = 1, nthreads = 0, opt;
+  double duration = 6;
+  bool resize_storm = false, switch_context = false, measure_error = false;
+  while ((opt = getopt(argc, argv, "l:s:w:p:t:rcen:")) != -1)
+    switch (opt)
+    {
+      case 'l': lib = optarg; break;
+      case 's': if (sscanf(optarg, "%dx%d", &width, &height) != 2) usage(); break;
+      case 'w': nwindows = atoi(optarg); break;
+      case 'p': nthreads = atoi(optarg); break;
+      case 't': duration = atof(optarg); break;
+      case 'r': resize_storm = true; break;
+      case 'c': switch_context = true; break;
+      case 'e': measure_error = true; break;
+      case 'n': label = optarg; break;
+      default: usage();
+    }
+  die_if(nwindows < 1 || nthreads < 0 || width < 1 || height < 1, "invalid arguments\n");
+  die_if(nthreads && (nwindows > 1 || resize_storm || switch_context || measure_error),
+	 "-p does not combine with -w, -r, -c and -e\n");
+  gl.load(lib);
+  if (nthreads)
+    XInitThreads();
+
+  Display *dpy = XOpenDisplay(NULL);
+  die_if(!dpy, "failed to open display\n");
+  int attrs[] = {GLX_RGBA, GLX_DOUBLEBUFFER, GLX_RED_SIZE, 8, GLX_GREEN_SIZE, 8, GLX_BLUE_SIZE, 8,
+		 GLX_DEPTH_SIZE, 24, None};
+  XVisualInfo *vis = gl.glXChooseVisual(dpy, DefaultScreen(dpy), attrs);
+  die_if(!vis, "no suitable visual\n");
+  Window root = RootWindow(dpy, vis->screen);
+  XSetWindowAttributes swa;
+  swa.colormap = XCreateColormap(dpy, root, vis->visual, AllocNone);
+  swa.border_pixel = 0;
+  Window *windows = new Window[nwindows];
+  for (int i = 0; i < nwindows; i++)
+  {
+    windows[i] = XCreateWindow(dpy, root, 16 * i, 16 * i, width, height, 0, vis->depth, InputOutput,
+			       vis->visual, CWColormap | CWBorderPixel, &swa);
+    XMapWindow(dpy, windows[i]);
+  }
+  XSync(dpy, False);
+  GLXContext ctx = gl.glXCreateContext(dpy, vis, NULL, True);
+  die_if(!ctx, "failed to create context\n");
+
+  double start = get_time(CLOCK_MONOTONIC), now = start;
+  int frames = 0, w = width, h = height;
+  bool switched = false;
+  if (nthreads)
+  {
+    // The main window stays idle; frames are summed over the threads' windows
+    RenderThread *threads = new RenderThread[nthreads];
+    for (int i = 0; i < nthreads; i++)
+    {
+      threads[i].index = i;
+      threads[i].width = width;
+      threads[i].height = height;
+      threads[i].duration = duration;
+      pthread_create(&threads[i].thread, NULL, render_thread, &threads[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+      pthread_join(threads[i].thread, NULL);
+      frames += threads[i].frames;
+    }
+    delete[] threads;
+    now = get_time(CLOCK_MONOTONIC);
+  }
+  while (!nthreads && (now = get_time(CLOCK_MONOTONIC)) - start < duration)
+  {
+    double progress = (now - start) / duration;
+    if (switch_context && !switched && progress >= 0.5)
+    {
+      GLXContext other = gl.glXCreateContext(dpy, vis, NULL, True);
+      gl.glXMakeCurrent(dpy, None, NULL);
+      gl.glXDestroyContext(dpy, ctx);
+      ctx = other;
+      switched = true;
+    }
+    if (resize_storm && progress >= 1. / 3 && progress < 2. / 3)
+    {
+      w = width - (frames % 64) * width / 128;
+      h = height - (frames % 48) * height / 96;
+      for (int i = 0; i < nwindows; i++)
+	XResizeWindow(dpy, windows[i], w, h);
+    }
+    else if (w != width || h != height)
+    {
+      w = width;
+      h = height;
+      for (int i = 0; i < nwindows; i++)
+	XResizeWindow(dpy, windows[i], w, h);
+    }
+    for (int i = 0; i < nwindows; i++)
+    {
+      gl.glXMakeCurrent(dpy, windows[i], ctx);
+      draw_frame(frames, w, h);
+      gl.glXSwapBuffers(dpy, windows[i]);
+    }
+    frames++;
+  }
+  double elapsed = now - start, psnr = -1;
+  if (measure_error)
+  {
+    gl.glXMakeCurrent(dpy, windows[0], ctx);
+    draw_frame(frames, width, height);
+    psnr = measure_psnr(dpy, windows[0], width, height);
+  }
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double user = rusage_seconds(ru.ru_utime), sys = rusage_seconds(ru.ru_stime);
+  const char *sync = getenv("PRIMUS_SYNC"), *format = getenv("PRIMUS_FORMAT");
+  // Bytes per pixel going through readback and upload for each PRIMUS_FORMAT
+  static const int format_bytes[] = {4, 3, 2};
+  int bytes = format && atoi(format) > 0 && atoi(format) < 3 ? format_bytes[atoi(format)] : 4;
+  double mpixels = 1e-6 * frames * nwindows * width * height / elapsed;
+  printf("{\"label\": \"%s\", \"width\": %d, \"height\": %d, \"windows\": %d, \"sync\": \"%s\", "
+	 "\"threads\": %d, \"format\": \"%s\", \"resize_storm\": %s, \"context_switch\": %s, \"frames\": %d, "
+	 "\"seconds\": %.3f, \"fps\": %.2f, \"mpixels_per_s\": %.2f, \"transfer_mb_per_s\": %.2f, "
+	 "\"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"cpu_ms_per_frame\": %.3f",
+	 label, width, height, nthreads ? nthreads : nwindows, sync ? sync : "", nthreads,
+	 format ? format : "",
+	 resize_storm ? "true" : "false", switch_context ? "true" : "false", frames * nwindows, elapsed,
+	 frames * nwindows / elapsed, mpixels, mpixels * bytes, user, sys,
+	 1e3 * (user + sys) / (frames ? frames * nwindows : 1));
+  if (psnr >= 0)
+    printf(", \"psnr_db\": %.2f", psnr);
+  printf("}\n");
+
+  gl.glXMakeCurrent(dpy, None, NULL);
+  gl.glXDestroyContext(dpy, ctx);
+  for (int i = 0; i < nwindows; i++)
+    XDestroyWindow(dpy, windows[i]);
+  delete[] windows;
+  XFree(vis);
+  XCloseDisplay(dpy);
+  return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/bash
+# Run the pipeline benchmark sweep against the libGL built in $1/lib.
+# Two Xvfb servers stand in for the application (primary) and the rendering
+# (secondary) X servers; Mesa's llvmpipe renders on both.  Each run appends
+# one summary line to $1/results.jsonl; per-stage latencies from the primus
+# profilers go to $1/profile/<run>.json.
+
+out=${1:-bench/build}
+lib=$out/lib/libGL.so.1
+duration=${BENCH_DURATION:-6}
+sizes=${BENCH_SIZES:-"1280x720 1920x1080 2560x1440 3840x2160"}
+windows=${BENCH_WINDOWS:-"1 2 4"}
+syncs=${BENCH_SYNC:-"0 1 2"}
+primary=${BENCH_PRIMARY:-:91}
+secondary=${BENCH_SECONDARY:-:92}
+
+# Mesa's libGL, for both sides of primus
+MESA_LIBGL=${MESA_LIBGL:-$(ldconfig -p | sed -n 's/.*libGL\.so\.1 .*=> //p' | head -n 1)}
+if [ ! -e "$lib" ] || [ -z "$MESA_LIBGL" ]; then
+  echo "run.sh: need $lib and Mesa libGL (set MESA_LIBGL)" >&2
+  exit 1
+fi
+
+Xvfb $primary -screen 0 3840x2160x24 +extension GLX -nolisten tcp &
+xvfb_primary=$!
+Xvfb $secondary -screen 0 3840x2160x24 +extension GLX -nolisten tcp &
+xvfb_secondary=$!
+trap 'kill $xvfb_primary $xvfb_secondary 2>/dev/null' EXIT
+sleep 1
+
+export DISPLAY=$primary
+export PRIMUS_DISPLAY=$secondary
+export PRIMUS_libGLa=$MESA_LIBGL
+export PRIMUS_libGLd=$MESA_LIBGL
+export PRIMUS_VERBOSE=0
+export LIBGL_ALWAYS_SOFTWARE=1
+export GALLIUM_DRIVER=llvmpipe
+
+mkdir -p $out/profile
+results=$out/results.jsonl
+: > $results
+
+run() {
+  local name=$1
+  shift
+  PRIMUS_PROFILE=$out/profile/$name.json \
+    $out/primusbench -l $lib -t $duration -n $name "$@" | tee -a $results
+}
+
+for sync in $syncs; do
+  export PRIMUS_SYNC=$sync
+  for size in $sizes; do
+    for n in $windows; do
+      run sync$sync-$size-w$n -s $size -w $n
+    done
+  done
+  run sync$sync-resize -s 1920x1080 -r
+  run sync$sync-ctxswitch -s 1920x1080 -c
+done
+
+# Bandwidth against visual error of the transfer formats
+export PRIMUS_SYNC=2
+for format in ${BENCH_FORMATS:-"0 1 2"}; do
+  for size in 1920x1080 3840x2160; do
+    PRIMUS_FORMAT=$format run format$format-$size -s $size -e
+  done
+done
+
+# Rendering at reduced resolution, upscaled for display
+for scale in ${BENCH_SCALES:-"100 75 50"}; do
+  PRIMUS_SCALE=$scale run scale$scale-3840x2160 -s 3840x2160
+done
+
+# Windows rendered concurrently from separate application threads
+export PRIMUS_SYNC=0
+for n in ${BENCH_THREADS:-"1 2 4"}; do
+  run threads$n-1920x1080 -s 1920x1080 -p $n
+done
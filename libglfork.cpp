@@ -4,18 +4,26 @@
 #include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sched.h>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include <cstdio>
 #include <cassert>
-#include <map>
 #include <X11/Xatom.h>
 #pragma GCC visibility push(default)
 #define GLX_GLXEXT_PROTOTYPES
 #define GL_GLEXT_PROTOTYPES
 #include <GL/glx.h>
 #pragma GCC visibility pop
+#include <X11/extensions/XShm.h>
+#include <X11/Xlibint.h>
+#include <X11/extensions/presentproto.h>
 
 #define primus_print(c, ...) do { if (c) fprintf(stderr, "primus: " __VA_ARGS__); } while (0)
 
@@ -57,9 +65,11 @@ struct CapturedFns {
 #include "glx-dpyredir.def"
 #include "glxext-reimpl.def"
 #include "gl-passthru.def"
+#include "gl-reimpl.def"
 #include "gl-needed.def"
 #undef DEF_GLX_PROTO
-  CapturedFns(const char *lib)
+  CapturedFns(): handle(NULL) {}
+  void load(const char *lib)
   {
     handle = mdlopen(lib, RTLD_LAZY);
 #define DEF_GLX_PROTO(ret, name, args, ...) name = (ret (*) args)real_dlsym(handle, #name);
@@ -69,12 +79,63 @@ struct CapturedFns {
 #define DEF_GLX_PROTO(ret, name, args, ...) name = (ret (*) args)this->glXGetProcAddress((GLubyte*)#name);
 #include "glxext-reimpl.def"
 #include "gl-passthru.def"
+#include "gl-reimpl.def"
 #include "gl-needed.def"
 #undef DEF_GLX_PROTO
   }
   ~CapturedFns()
   {
-    dlclose(handle);
+    if (handle)
+      dlclose(handle);
+  }
+};
+
+// Division of a frame into square tiles; tiles in the last row and column
+// may be clipped
+struct TileGrid {
+  int width, height;
+  int size, cols, rows;
+
+  int ntiles() const
+  {
+    return cols * rows;
+  }
+  // Without a positive tile size, the whole frame is one tile
+  void init(int tile_size, int width, int height)
+  {
+    this->width = width;
+    this->height = height;
+    size = tile_size > 0 ? tile_size : width > height ? width : height;
+    if (size < 1)
+      size = 1;
+    cols = (width + size - 1) / size;
+    rows = (height + size - 1) / size;
+  }
+  bool operator!=(const TileGrid &other) const
+  {
+    return width != other.width || height != other.height || size != other.size;
+  }
+};
+
+// Lock for rare contention that may be held for a while; zero-initialized.
+// Waiters yield at first, then poll every 100 microseconds.
+struct YieldLock {
+  int locked;
+
+  void lock()
+  {
+    for (int i = 0; __atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE); i++)
+      if (i < 16)
+	sched_yield();
+      else
+      {
+	struct timespec tp = {0, 100000};
+	nanosleep(&tp, NULL);
+      }
+  }
+  void unlock()
+  {
+    __atomic_store_n(&locked, 0, __ATOMIC_RELEASE);
   }
 };
 
@@ -84,66 +145,556 @@ struct DrawableInfo {
   enum {XWindow, Window, Pixmap, Pbuffer} kind;
   GLXFBConfig fbconfig;
   GLXPbuffer  pbuffer;
+  // Pbuffers of other FBConfigs the window was rendered with, for switching
+  // back to them; least recently used first
+  enum {MAX_CACHED = 4};
+  struct CachedPbuffer {
+    GLXFBConfig fbconfig;
+    GLXPbuffer pbuffer;
+    int width, height;
+  } cached[MAX_CACHED];
+  int ncached;
+  // Bumped when the pbuffer is replaced, so that threads that have the old
+  // one current notice and rebind
+  unsigned pbuffer_gen;
+  // Serializes swaps and pbuffer changes of drawables that are current in
+  // several application threads
+  YieldLock lock;
   Drawable window;
   int width, height;
+  // Size of the pbuffer and of buffers along the pipeline; grows and shrinks in
+  // steps, so that most resizes only change the part that is read back
+  int alloc_width, alloc_height;
   enum ReinitTodo {NONE, RESIZE, SHUTDOWN} reinit;
-  GLvoid *pixeldata;
   GLsync sync;
+  double swap_time;
+  // Swap interval requested by the application plus one; 0: none requested
+  int swap_request;
+  // Pacing of swaps by the application thread: when the next one is due, and
+  // how late the previous one returned (negative: not paced)
+  double deadline, lateness;
+  // Refresh period of the window's screen, once the display worker knows it
+  long refresh_ns;
+  // Set by the display worker while the window is unmapped or fully
+  // obscured; frames are then neither read back nor displayed
+  bool hidden;
+  // A swap or copy was skipped while hidden, so the next one reads back the
+  // whole frame
+  bool skipped;
+  // Percentage of the window size that frames are rendered and read back at;
+  // the display worker scales them up to the window
+  int scale;
+  // With PRIMUS_SCALE_TARGET_MS: when the application started on the current
+  // frame, not counting pacing, its average time per frame in milliseconds,
+  // and when the scale last changed
+  double frame_start, frame_ms, scale_time;
   GLXContext actx;
+  int sharegroup; // of actx
+  pthread_t owner; // thread that started the pipeline
+
+  // Bounded single-producer single-consumer queue passing frames (or reinit
+  // requests) from the readback worker to the display worker
+  struct FrameQueue {
+    struct Slot {
+      ReinitTodo reinit;
+      // Frame size, or allocation size for reinit
+      TileGrid grid;
+      int out_width, out_height; // size to show the frame at
+      GLvoid *pixeldata;
+      double swap_time;
+      int sync; // mode the frame was read back in
+      // Tiles that changed since the previous frame in the queue
+      unsigned char *changed;
+    } *slots;
+    int capacity;
+    unsigned head, tail;
+    sem_t items, spaces;
+
+    void init(int capacity)
+    {
+      this->capacity = capacity;
+      slots = new Slot[capacity]();
+      head = tail = 0;
+      sem_init(&items, 0, 0);
+      sem_init(&spaces, 0, capacity);
+    }
+    void destroy()
+    {
+      resize_tiles(0);
+      delete[] slots;
+      sem_destroy(&spaces);
+      sem_destroy(&items);
+    }
+    void resize_tiles(int ntiles)
+    {
+      for (int i = 0; i < capacity; i++)
+      {
+	delete[] slots[i].changed;
+	slots[i].changed = ntiles ? new unsigned char[ntiles] : NULL;
+      }
+    }
+    int occupancy()
+    {
+      return __atomic_load_n(&head, __ATOMIC_RELAXED) - __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+    // Producer: wait for a free slot (until timeout, if given) and fill it
+    bool acquire(const struct timespec *timeout)
+    {
+      int r;
+      while ((r = timeout ? sem_timedwait(&spaces, timeout) : sem_wait(&spaces)) && errno == EINTR);
+      return !r;
+    }
+    Slot &back()
+    {
+      return slots[head % capacity];
+    }
+    void push()
+    {
+      __atomic_store_n(&head, head + 1, __ATOMIC_RELAXED);
+      sem_post(&items);
+    }
+    // Producer: wait until the consumer has released all slots
+    bool drain(const struct timespec *timeout)
+    {
+      for (int i = 0; i < capacity; i++)
+	if (!acquire(timeout))
+	{
+	  while (i--)
+	    sem_post(&spaces);
+	  return false;
+	}
+      for (int i = 0; i < capacity; i++)
+	sem_post(&spaces);
+      return true;
+    }
+    // Consumer: wait for the oldest slot, and release it when done with it
+    Slot &front()
+    {
+      while (sem_wait(&items) && errno == EINTR);
+      return slots[tail % capacity];
+    }
+    void pop()
+    {
+      __atomic_store_n(&tail, tail + 1, __ATOMIC_RELAXED);
+      sem_post(&spaces);
+    }
+  } queue;
+
+  // Triple buffer for PRIMUS_SYNC=4: the readback worker fills the back slot
+  // and swaps it with the mailbox slot, the display worker swaps its front
+  // slot with the mailbox slot if that holds a frame it has not taken yet.
+  // Neither side waits for the other; unseen frames are superseded.  Slot i
+  // reads back into PBO i.  The queue still carries reinit requests.
+  struct Mailbox {
+    enum {FRESH = 4};
+    FrameQueue::Slot slots[3];
+    unsigned state; // index of the mailbox slot, and FRESH
+    int back, front;
+
+    // With both workers idle
+    void reset()
+    {
+      back = 0;
+      state = 1;
+      front = 2;
+    }
+    void resize_tiles(int ntiles)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+	delete[] slots[i].changed;
+	slots[i].changed = ntiles ? new unsigned char[ntiles] : NULL;
+      }
+    }
+    // Producer: whether the last published frame is still waiting
+    bool pending()
+    {
+      return __atomic_load_n(&state, __ATOMIC_ACQUIRE) & FRESH;
+    }
+    // Producer: returns true if an unseen frame was superseded
+    bool publish()
+    {
+      unsigned old = __atomic_exchange_n(&state, back | FRESH, __ATOMIC_ACQ_REL);
+      back = old & ~FRESH;
+      return old & FRESH;
+    }
+    // Consumer: the latest frame, or NULL if it was already taken
+    FrameQueue::Slot *take()
+    {
+      if (!(__atomic_load_n(&state, __ATOMIC_ACQUIRE) & FRESH))
+	return NULL;
+      front = __atomic_exchange_n(&state, front, __ATOMIC_ACQ_REL) & ~FRESH;
+      return &slots[front];
+    }
+  } mailbox;
 
+  // Frames go through pool workers from the first swap on
+  bool pipelined;
+  int worker; // index of the pool workers serving this drawable
   struct {
-    pthread_t worker;
-    sem_t acqsem, relsem;
+    sem_t relsem;
     ReinitTodo reinit;
+    // Size of frames to read back, within the allocation, and of the window
+    // they are shown on
+    int width, height, out_width, out_height;
+    // Rectangle of glXCopySubBufferMESA: x, y, width, height; empty: all
+    int sub[4];
+  } r;
+  // Per-drawable state kept by the workers
+  struct ReadbackState *rstate;
+  struct DisplayState *dstate;
+  void start_pipeline(int depth);
+  void stop_pipeline();
+  ~DrawableInfo();
+};
+
+// Hash table from XIDs or pointers to heap-allocated values, which keep their
+// address until erased.  Lookups take no locks: writers are serialized by a
+// mutex, publish entries by storing the key last, leave erased keys in place
+// as tombstones, and on growth retire the old table instead of freeing it, as
+// readers may still be probing it.  Erasing advances a generation counter that
+// lets threads validate cached lookups.  Key 0 marks empty slots and is never
+// stored.
+template<typename Key, typename Value>
+class Registry {
+  struct Table {
+    struct Entry {
+      uintptr_t key; // 0: never used
+      Value *value;  // NULL: erased
+    } *entries;
+    size_t mask, used;
+    Table *retired;
+  } *table;
+  size_t live;
+  unsigned gen;
+  pthread_mutex_t lock;
 
-    void spawn_worker(GLXDrawable draw, void* (*work)(void*))
+  static size_t hash(uintptr_t key)
+  {
+    unsigned long long h = key * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 29);
+  }
+  static Table *new_table(size_t size, Table *retired)
+  {
+    Table *t = new Table;
+    t->entries = new typename Table::Entry[size]();
+    t->mask = size - 1;
+    t->used = 0;
+    t->retired = retired;
+    return t;
+  }
+  static typename Table::Entry *probe(Table *t, uintptr_t key)
+  {
+    typename Table::Entry *e;
+    for (size_t i = hash(key);; i++)
+    {
+      e = &t->entries[i & t->mask];
+      uintptr_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+      if (!k || k == key)
+	return e;
+    }
+  }
+  // With the lock held: move live entries to a table with room for more
+  void grow()
+  {
+    size_t size = 16;
+    while (size < live * 4)
+      size *= 2;
+    Table *t = new_table(size, table);
+    for (size_t i = 0; i <= table->mask; i++)
+      if (Value *v = table->entries[i].value)
+      {
+	typename Table::Entry *e = probe(t, table->entries[i].key);
+	e->value = v;
+	e->key = table->entries[i].key;
+	t->used++;
+      }
+    __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+  }
+public:
+  Registry(): table(new_table(16, NULL)), live(0), gen(0)
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+  ~Registry()
+  {
+    for (size_t i = 0; i <= table->mask; i++)
+      delete table->entries[i].value;
+    for (Table *t = table, *next; t; t = next)
     {
-      reinit = RESIZE;
-      sem_init(&acqsem, 0, 0);
-      sem_init(&relsem, 0, 0);
-      pthread_create(&worker, NULL, work, (void*)draw);
+      next = t->retired;
+      delete[] t->entries;
+      delete t;
     }
-    void reap_worker()
+    pthread_mutex_destroy(&lock);
+  }
+  Value *find(Key key) const
+  {
+    if (!key)
+      return NULL;
+    Table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&probe(t, (uintptr_t)key)->value, __ATOMIC_ACQUIRE);
+  }
+  bool known(Key key) const
+  {
+    return find(key) != NULL;
+  }
+  // Find the value for the key, adding a value-initialized one if absent
+  Value &operator[](Key key)
+  {
+    if (Value *v = find(key))
+      return *v;
+    die_if(!key, "registry key 0 is reserved\n");
+    pthread_mutex_lock(&lock);
+    typename Table::Entry *e = probe(table, (uintptr_t)key);
+    if (!e->value)
     {
-      //pthread_cancel(worker);
-      pthread_join(worker, NULL);
-      sem_destroy(&relsem);
-      sem_destroy(&acqsem);
-      worker = 0;
+      if (!e->key && (table->used + 1) * 2 > table->mask + 1)
+      {
+	grow();
+	e = probe(table, (uintptr_t)key);
+      }
+      __atomic_store_n(&e->value, new Value(), __ATOMIC_RELEASE);
+      if (!e->key)
+      {
+	__atomic_store_n(&e->key, (uintptr_t)key, __ATOMIC_RELEASE);
+	table->used++;
+      }
+      __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
     }
-  } r, d;
-  void reap_workers()
+    Value *v = e->value;
+    pthread_mutex_unlock(&lock);
+    return *v;
+  }
+  void erase(Key key)
   {
-    if (r.worker)
+    if (!key)
+      return;
+    pthread_mutex_lock(&lock);
+    typename Table::Entry *e = probe(table, (uintptr_t)key);
+    Value *v = e->value;
+    if (v)
     {
-      r.reinit = SHUTDOWN;
-      sem_post(&r.acqsem);
-      sem_wait(&r.relsem);
-      r.reap_worker();
-      d.reap_worker();
+      __atomic_store_n(&e->value, (Value *)NULL, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&gen, 1, __ATOMIC_RELEASE);
+      __atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&lock);
+    delete v;
   }
-  ~DrawableInfo();
-};
-
-struct DrawablesInfo: public std::map<GLXDrawable, DrawableInfo> {
-  bool known(GLXDrawable draw)
+  bool empty() const
+  {
+    return !__atomic_load_n(&live, __ATOMIC_RELAXED);
+  }
+  unsigned generation() const
+  {
+    return __atomic_load_n(&gen, __ATOMIC_ACQUIRE);
+  }
+  // Call fn on each value, with other writers locked out
+  void for_each(void (*fn)(Value &))
+  {
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i <= table->mask; i++)
+      if (Value *v = table->entries[i].value)
+	fn(*v);
+    pthread_mutex_unlock(&lock);
+  }
+  template<typename Arg>
+  void for_each(void (*fn)(Value &, Arg), Arg arg)
   {
-    return this->find(draw) != this->end();
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i <= table->mask; i++)
+      if (Value *v = table->entries[i].value)
+	fn(*v, arg);
+    pthread_mutex_unlock(&lock);
   }
 };
 
+typedef Registry<GLXDrawable, DrawableInfo> DrawablesInfo;
+
 struct ContextInfo {
   GLXFBConfig fbconfig;
   int sharegroup;
+  int *sharegroup_contexts; // live contexts of the sharegroup, shared by them
+  // Viewport and scissor box as the application set them, and the render
+  // scale they were applied with; 0: set for a framebuffer object, -1: not
+  // applied yet
+  GLint viewport[4], scissor[4];
+  int viewport_scale, scissor_scale;
+  bool made_current;
 };
 
-struct ContextsInfo: public std::map<GLXContext, ContextInfo> {
+struct ContextsInfo: public Registry<GLXContext, ContextInfo> {
   void record(GLXContext ctx, GLXFBConfig config, GLXContext share)
   {
     static int nsharegroups;
-    int sharegroup = share ? (*this)[share].sharegroup : nsharegroups++;
-    (*this)[ctx] = (ContextInfo){config, sharegroup};
+    ContextInfo *shared = share ? find(share) : NULL;
+    ContextInfo &ci = (*this)[ctx];
+    ci.fbconfig = config;
+    ci.sharegroup = shared ? shared->sharegroup : __atomic_fetch_add(&nsharegroups, 1, __ATOMIC_RELAXED);
+    ci.sharegroup_contexts = shared ? shared->sharegroup_contexts : new int(0);
+    __atomic_add_fetch(ci.sharegroup_contexts, 1, __ATOMIC_RELAXED);
+    ci.viewport_scale = ci.scissor_scale = 0;
+    ci.made_current = false;
+  }
+};
+
+// Match between a ddpy Visual and an adpy FBConfig, found once and kept for
+// repeated queries; valid once known is set
+struct ConfigMatch {
+  bool known;
+  GLXFBConfig config; // for a Visual; NULL: none
+  VisualID visualid;  // for an FBConfig; 0: none
+};
+typedef Registry<VisualID, ConfigMatch> VisualConfigs;
+typedef Registry<GLXFBConfig, ConfigMatch> ConfigVisuals;
+
+// FIFO of drawables with work for a pool worker; NULL asks the worker to exit,
+// or with a sharegroup given, to destroy its contexts of that sharegroup
+struct JobQueue {
+  struct Job {
+    DrawableInfo *di;
+    int reap; // sharegroup, or -1
+    bool mailbox; // the frame is in the drawable's mailbox, not its queue
+  } *jobs;
+  unsigned size, head, tail;
+  pthread_mutex_t lock;
+  sem_t ready;
+
+  void init()
+  {
+    jobs = new Job[size = 8];
+    head = tail = 0;
+    pthread_mutex_init(&lock, NULL);
+    sem_init(&ready, 0, 0);
+  }
+  void destroy()
+  {
+    sem_destroy(&ready);
+    pthread_mutex_destroy(&lock);
+    delete[] jobs;
+  }
+  void push(DrawableInfo *di, int reap = -1, bool mailbox = false)
+  {
+    pthread_mutex_lock(&lock);
+    if (head - tail == size)
+    {
+      Job *grown = new Job[size * 2];
+      for (unsigned i = tail; i != head; i++)
+	grown[i % (size * 2)] = jobs[i % size];
+      delete[] jobs;
+      jobs = grown;
+      size *= 2;
+    }
+    Job job = {di, reap, mailbox};
+    jobs[head++ % size] = job;
+    pthread_mutex_unlock(&lock);
+    sem_post(&ready);
+  }
+  Job pop()
+  {
+    while (sem_wait(&ready) && errno == EINTR);
+    return take();
+  }
+  // Like pop(), but returns false if there is no job by the timeout
+  bool pop(Job *job, const struct timespec *timeout)
+  {
+    int r;
+    while ((r = sem_timedwait(&ready, timeout)) && errno == EINTR);
+    if (r)
+      return false;
+    *job = take();
+    return true;
+  }
+private:
+  Job take()
+  {
+    pthread_mutex_lock(&lock);
+    Job job = jobs[tail++ % size];
+    pthread_mutex_unlock(&lock);
+    return job;
+  }
+};
+
+// Readback and display threads shared by all drawables.  Each drawable is
+// pinned to one worker of each kind, which keeps its frames in order; workers
+// start with the first swap and exit when the last context is destroyed.
+struct WorkerPool {
+  struct Worker {
+    pthread_t thread;
+    JobQueue jobs;
+    int ndrawables;
+  } *readback, *display;
+  int nworkers;
+  bool running;
+  pthread_mutex_t lock;
+
+  WorkerPool(int nworkers): nworkers(nworkers), running(false)
+  {
+    readback = new Worker[nworkers]();
+    display = new Worker[nworkers]();
+    pthread_mutex_init(&lock, NULL);
+  }
+  ~WorkerPool()
+  {
+    stop();
+    pthread_mutex_destroy(&lock);
+    delete[] display;
+    delete[] readback;
+  }
+  // Start workers if needed, and pick the least loaded ones for a drawable
+  int assign(void* (*rwork)(void*), void* (*dwork)(void*))
+  {
+    pthread_mutex_lock(&lock);
+    if (!running)
+      for (int i = 0; i < nworkers; i++)
+      {
+	readback[i].jobs.init();
+	display[i].jobs.init();
+	pthread_create(&display[i].thread, NULL, dwork, &display[i]);
+	pthread_create(&readback[i].thread, NULL, rwork, &readback[i]);
+      }
+    running = true;
+    int best = 0;
+    for (int i = 1; i < nworkers; i++)
+      if (readback[i].ndrawables < readback[best].ndrawables)
+	best = i;
+    readback[best].ndrawables++;
+    display[best].ndrawables++;
+    pthread_mutex_unlock(&lock);
+    return best;
+  }
+  void release(int i)
+  {
+    pthread_mutex_lock(&lock);
+    readback[i].ndrawables--;
+    display[i].ndrawables--;
+    pthread_mutex_unlock(&lock);
+  }
+  // Have readback workers destroy their contexts of a sharegroup, which keep
+  // its objects alive; no pipeline may use the sharegroup any more
+  void reap(int sharegroup)
+  {
+    pthread_mutex_lock(&lock);
+    for (int i = 0; running && i < nworkers; i++)
+      readback[i].jobs.push(NULL, sharegroup);
+    pthread_mutex_unlock(&lock);
+  }
+  // Workers must have no drawables left
+  void stop()
+  {
+    pthread_mutex_lock(&lock);
+    for (int i = 0; running && i < nworkers; i++)
+    {
+      readback[i].jobs.push(NULL);
+      pthread_join(readback[i].thread, NULL);
+      display[i].jobs.push(NULL);
+      pthread_join(display[i].thread, NULL);
+      readback[i].jobs.destroy();
+      display[i].jobs.destroy();
+    }
+    running = false;
+    pthread_mutex_unlock(&lock);
   }
 };
 
@@ -151,67 +702,101 @@ struct ContextsInfo: public std::map<GLXContext, ContextInfo> {
 // overridden by environment
 #define getconf(V) (getenv(#V) ? getenv(#V) : V)
 
-// Runs before all other initialization takes place
-struct EarlyInitializer {
-  EarlyInitializer()
-  {
+// Runs before the X displays are opened and the libraries loaded
+static void contact_bumblebee()
+{
 #ifdef BUMBLEBEE_SOCKET
-    // Signal the Bumblebee daemon to bring up secondary X
-    errno = 0;
-    int sock = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, getconf(BUMBLEBEE_SOCKET), sizeof(addr.sun_path));
-    connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-    die_if(errno, "failed to connect to Bumblebee daemon: %s\n", strerror(errno));
-    static char c[256];
-    if (!getenv("PRIMUS_DISPLAY"))
-    {
-      send(sock, "Q VirtualDisplay", strlen("Q VirtualDisplay") + 1, 0);
-      recv(sock, &c, 255, 0);
-      die_if(memcmp(c, "Value: ", strlen("Value: ")), "unexpected query response\n");
-      *strchrnul(c, '\n') = 0;
-      setenv("PRIMUS_DISPLAY", c + 7, 1);
-    }
-    if (!getenv("PRIMUS_libGLa"))
-    {
-      send(sock, "Q LibraryPath", strlen("Q LibraryPath") + 1, 0);
-      recv(sock, &c, 255, 0);
-      die_if(memcmp(c, "Value: ", strlen("Value: ")), "unexpected query response\n");
-      *strchrnul(c, '\n') = 0;
-      int npaths = 0;
-      for (char *p = c + 7; *p; npaths++, p = strchrnul(p + 1, ':'));
-      if (npaths)
+  // Signal the Bumblebee daemon to bring up secondary X
+  errno = 0;
+  int sock = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr;
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, getconf(BUMBLEBEE_SOCKET), sizeof(addr.sun_path));
+  connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  die_if(errno, "failed to connect to Bumblebee daemon: %s\n", strerror(errno));
+  static char c[256];
+  if (!getenv("PRIMUS_DISPLAY"))
+  {
+    send(sock, "Q VirtualDisplay", strlen("Q VirtualDisplay") + 1, 0);
+    recv(sock, &c, 255, 0);
+    die_if(memcmp(c, "Value: ", strlen("Value: ")), "unexpected query response\n");
+    *strchrnul(c, '\n') = 0;
+    setenv("PRIMUS_DISPLAY", c + 7, 1);
+  }
+  if (!getenv("PRIMUS_libGLa"))
+  {
+    send(sock, "Q LibraryPath", strlen("Q LibraryPath") + 1, 0);
+    recv(sock, &c, 255, 0);
+    die_if(memcmp(c, "Value: ", strlen("Value: ")), "unexpected query response\n");
+    *strchrnul(c, '\n') = 0;
+    int npaths = 0;
+    for (char *p = c + 7; *p; npaths++, p = strchrnul(p + 1, ':'));
+    if (npaths)
+    {
+      char *bblibs = new char[strlen(c + 7) + npaths * strlen("/libGL.so.1") + 1], *b = bblibs, *n, *p;
+      for (p = c + 7; *p; p = n)
       {
-	char *bblibs = new char[strlen(c + 7) + npaths * strlen("/libGL.so.1") + 1], *b = bblibs, *n, *p;
-	for (p = c + 7; *p; p = n)
-	{
-	  n = strchrnul(p + 1, ':');
-	  b += sprintf(b, "%.*s/libGL.so.1", (int)(n - p), p);
-	}
-	setenv("PRIMUS_libGLa", bblibs, 1);
-	delete[] bblibs;
+	n = strchrnul(p + 1, ':');
+	b += sprintf(b, "%.*s/libGL.so.1", (int)(n - p), p);
       }
+      setenv("PRIMUS_libGLa", bblibs, 1);
+      delete[] bblibs;
     }
-    send(sock, "C", 1, 0);
-    recv(sock, &c, 255, 0);
-    die_if(c[0] == 'N', "Bumblebee daemon reported: %s\n", c + 5);
-    die_if(c[0] != 'Y', "failure contacting Bumblebee daemon\n");
-    // the socket will be closed when the application quits, then bumblebee will shut down the secondary X
+  }
+  send(sock, "C", 1, 0);
+  recv(sock, &c, 255, 0);
+  die_if(c[0] == 'N', "Bumblebee daemon reported: %s\n", c + 5);
+  die_if(c[0] != 'Y', "failure contacting Bumblebee daemon\n");
+  // the socket will be closed when the application quits, then bumblebee will shut down the secondary X
 #else
 #warning Building without Bumblebee daemon support
 #endif
-  }
+}
+
+// Pixel formats that frames can be read back and uploaded in; GL converts
+// from and to the framebuffer and texture formats
+struct TransferFormat {
+  GLenum format, type;
+  int bytes; // per pixel
+};
+static const TransferFormat transfer_formats[] = {
+  {GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, 4},
+  {GL_BGR, GL_UNSIGNED_BYTE, 3},
+  {GL_RGB, GL_UNSIGNED_SHORT_5_6_5, 2},
 };
 
 // Process-wide data
 static struct PrimusInfo {
-  EarlyInitializer ei;
   // Readback-display synchronization method
-  // 0: no sync, 1: D lags behind one frame, 2: fully synced
+  // 0: no sync, 1: D lags behind one frame, 2: fully synced,
+  // 3: chosen per drawable at runtime, 4: mailbox, D shows the latest frame
   int sync;
+  // With sync 3, frame rate loss (percent of the best seen) accepted for
+  // lower latency
+  int sync_tolerance;
   // 0: only errors, 1: warnings, 2: profiling
   int loglevel;
+  // Number of frames in flight between readback and display (PBOs and
+  // textures); synchronized modes use two
+  int queue_depth;
+  // Size of tiles checked for changes between frames; 0: no checking
+  int tile_size;
+  // How frames are put on the window
+  // 0: OpenGL on the displaying libGL, 1: MIT-SHM, 2: Present
+  int backend;
+  // Frame rate cap for all windows; 0: none
+  double fps_limit;
+  // Frame rate cap for windows that are not visible; 0: none
+  double hidden_fps;
+  // Render scale of windows in percent, and with a target frame time in
+  // milliseconds, the largest one of an adaptive scale; 100: no scaling
+  int scale;
+  double scale_target_ms;
+  // Budget of each window for pbuffers of FBConfigs not currently in use
+  int pbuffer_cache_mb;
+  // Format of frames between readback and display
+  // 0: BGRA, 1: packed BGR, 2: RGB565
+  const TransferFormat *format;
   // The "accelerating" X display
   Display *adpy;
   // The "displaying" X display. The same as the application is using, but
@@ -222,78 +807,436 @@ static struct PrimusInfo {
   const void *needed_global;
   CapturedFns afns;
   CapturedFns dfns;
-  // FIXME: there are race conditions in accesses to these
+  // Workers must outlive drawables, which shut down their pipelines
+  WorkerPool workers;
   DrawablesInfo drawables;
   ContextsInfo contexts;
+  VisualConfigs visual_configs;
+  ConfigVisuals config_visuals;
   GLXFBConfig *dconfigs;
 
+  // Bumblebee is contacted and the displays opened only once the application
+  // calls into GLX
+  pthread_once_t once;
+
   PrimusInfo():
     sync(atoi(getconf(PRIMUS_SYNC))),
+    sync_tolerance(atoi(getconf(PRIMUS_SYNC_TOLERANCE))),
     loglevel(atoi(getconf(PRIMUS_VERBOSE))),
-    adpy(XOpenDisplay(getconf(PRIMUS_DISPLAY))),
-    ddpy(XOpenDisplay(NULL)),
-    needed_global(dlopen(getconf(PRIMUS_LOAD_GLOBAL), RTLD_LAZY | RTLD_GLOBAL)),
-    afns(getconf(PRIMUS_libGLa)),
-    dfns(getconf(PRIMUS_libGLd))
+    queue_depth(atoi(getconf(PRIMUS_QUEUE_DEPTH))),
+    tile_size(atoi(getconf(PRIMUS_TILE_SIZE))),
+    backend(atoi(getconf(PRIMUS_BACKEND))),
+    fps_limit(atof(getconf(PRIMUS_FPS_LIMIT))),
+    hidden_fps(atof(getconf(PRIMUS_HIDDEN_FPS))),
+    scale(atoi(getconf(PRIMUS_SCALE))),
+    scale_target_ms(atof(getconf(PRIMUS_SCALE_TARGET_MS))),
+    pbuffer_cache_mb(atoi(getconf(PRIMUS_PBUFFER_CACHE_MB))),
+    format(&transfer_formats[0]),
+    adpy(NULL), ddpy(NULL), needed_global(dlopen(getconf(PRIMUS_LOAD_GLOBAL), RTLD_LAZY | RTLD_GLOBAL)),
+    workers(atoi(getconf(PRIMUS_WORKERS)) > 0 ? atoi(getconf(PRIMUS_WORKERS)) : 1),
+    dconfigs(NULL), once(PTHREAD_ONCE_INIT)
   {
-    die_if(!adpy, "failed to open secondary X display\n");
+    if ((sync == 1 || sync == 2 || sync == 4) && queue_depth > 2)
+      primus_print(loglevel >= 1, "warning: PRIMUS_QUEUE_DEPTH has no effect with PRIMUS_SYNC=%d\n", sync);
+    if (sync == 1 || sync == 2 || queue_depth < 2)
+      queue_depth = 2;
+    if (sync == 4)
+      queue_depth = 3; // one PBO per mailbox slot
+    unsigned nformat = atoi(getconf(PRIMUS_FORMAT));
+    if (nformat < sizeof(transfer_formats) / sizeof(transfer_formats[0]))
+      format = &transfer_formats[nformat];
+    else
+      primus_print(loglevel >= 1, "warning: unknown PRIMUS_FORMAT %u, using 0\n", nformat);
+    if (scale <= 0 || scale > 100)
+    {
+      primus_print(loglevel >= 1, "warning: PRIMUS_SCALE must be within 1 and 100, using 100\n");
+      scale = 100;
+    }
+    if (backend != 0 && (scale < 100 || scale_target_ms > 0))
+    {
+      primus_print(loglevel >= 1, "warning: PRIMUS_SCALE needs PRIMUS_BACKEND=0\n");
+      scale = 100;
+      scale_target_ms = 0;
+    }
     die_if(!needed_global, "failed to load PRIMUS_LOAD_GLOBAL\n");
-    int ncfg, attrs[] = {GLX_DOUBLEBUFFER, GL_TRUE, None};
-    dconfigs = dfns.glXChooseFBConfig(ddpy, 0, attrs, &ncfg);
-    assert(ncfg);
+    afns.load(getconf(PRIMUS_libGLa));
+    dfns.load(getconf(PRIMUS_libGLd));
+  }
+  void init()
+  {
+    pthread_once(&once, initialize);
   }
+  static void initialize();
 } primus;
 
 // Thread-specific data
 static __thread struct {
   Display *dpy;
   GLXDrawable drawable, read_drawable;
-  void make_current(Display *dpy, GLXDrawable draw, GLXDrawable read)
+  // Cached lookup of the current drawable, valid while no drawable is erased
+  DrawableInfo *draw_info;
+  unsigned draw_gen;
+  // Generations of the pbuffers bound for the current drawables
+  unsigned draw_pbuffer_gen, read_pbuffer_gen;
+  void make_current(Display *dpy, GLXDrawable draw, GLXDrawable read, unsigned draw_gen, unsigned read_gen)
   {
     this->dpy = dpy;
     this->drawable = draw;
     this->read_drawable = read;
+    this->draw_info = NULL;
+    draw_pbuffer_gen = draw_gen;
+    read_pbuffer_gen = read_gen;
+  }
+  static unsigned pbuffer_gen(GLXDrawable draw)
+  {
+    DrawableInfo *di = draw ? primus.drawables.find(draw) : NULL;
+    return di ? __atomic_load_n(&di->pbuffer_gen, __ATOMIC_ACQUIRE) : 0;
+  }
+  // Whether another thread replaced a pbuffer bound in this one
+  bool stale()
+  {
+    return drawable && (draw_pbuffer_gen != pbuffer_gen(drawable) || read_pbuffer_gen != pbuffer_gen(read_drawable));
+  }
+  DrawableInfo *lookup(GLXDrawable draw)
+  {
+    unsigned gen = primus.drawables.generation();
+    if (draw != drawable || !draw_info || draw_gen != gen)
+    {
+      if (draw != drawable)
+	return primus.drawables.find(draw);
+      draw_info = primus.drawables.find(draw);
+      draw_gen = gen;
+    }
+    return draw_info;
   }
 } tsdata;
 
+static double get_time()
+{
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec + 1e-9 * tp.tv_nsec;
+}
+
+// Histogram of durations in buckets of at most 1/16 relative width, from a
+// microsecond to over two minutes; recording takes a few integer operations
+// and no locks, as each profiler is used from a single thread
+struct Histogram {
+  enum {SUB_BITS = 4, SUB = 1 << SUB_BITS, NBUCKETS = 24 * SUB};
+  unsigned counts[NBUCKETS];
+  unsigned total;
+  double sum, max;
+
+  Histogram()
+  {
+    clear();
+  }
+  void clear()
+  {
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    sum = max = 0;
+  }
+  void record(double seconds)
+  {
+    unsigned long us = seconds > 0 ? (unsigned long)(seconds * 1e6) : 0;
+    int b = us;
+    if (us >= SUB)
+    {
+      int e = 63 - __builtin_clzl(us);
+      b = (e - SUB_BITS + 1) * SUB + ((us >> (e - SUB_BITS)) & (SUB - 1));
+      if (b >= NBUCKETS)
+	b = NBUCKETS - 1;
+    }
+    counts[b]++;
+    total++;
+    sum += seconds;
+    if (seconds > max)
+      max = seconds;
+  }
+  // Upper bound of the bucket holding the given fraction of samples, in ms,
+  // capped by the largest sample
+  double percentile(double fraction) const
+  {
+    unsigned target = fraction * total + 0.5, seen = 0;
+    int b = 0;
+    while (b < NBUCKETS - 1 && (seen += counts[b]) < target)
+      b++;
+    double bound = b + 1;
+    if (b >= SUB)
+    {
+      int e = b / SUB - 1 + SUB_BITS;
+      bound = (unsigned long)(SUB + b % SUB + 1) << (e - SUB_BITS);
+    }
+    return bound * 1e-3 < max * 1e3 ? bound * 1e-3 : max * 1e3;
+  }
+};
+
+// Destination of profiling reports in addition to stderr, set by
+// PRIMUS_PROFILE: JSON lines if the file name ends in .json, CSV otherwise
+static struct ProfileLog {
+  FILE *file;
+  bool json;
+  pthread_mutex_t lock;
+
+  ProfileLog(): file(NULL), json(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+  void open()
+  {
+    const char *path = getconf(PRIMUS_PROFILE);
+    if (!*path)
+      return;
+    size_t len = strlen(path);
+    json = len >= 5 && !strcmp(path + len - 5, ".json");
+    file = fopen(path, "w");
+    if (!file)
+      primus_warn("failed to open PRIMUS_PROFILE: %s\n", strerror(errno));
+    else if (!json)
+      fputs("time,profiler,fps,metric,value,p50,p95,p99,max\n", file);
+  }
+  // One-off measurement outside of the periodic reports
+  void record(const char *profiler, const char *metric, double value)
+  {
+    if (!file)
+      return;
+    pthread_mutex_lock(&lock);
+    if (json)
+      fprintf(file, "{\"time\": %.3f, \"profiler\": \"%s\", \"%s\": %.3f}\n", get_time(), profiler, metric, value);
+    else
+      fprintf(file, "%.3f,%s,,%s,%.3f,,,,\n", get_time(), profiler, metric, value);
+    fflush(file);
+    pthread_mutex_unlock(&lock);
+  }
+  ~ProfileLog()
+  {
+    if (file)
+      fclose(file);
+    pthread_mutex_destroy(&lock);
+  }
+} profile_log;
+
+// Frame timeline in Chrome trace format (also loaded by Perfetto), written to
+// the file named by PRIMUS_TRACE.  Threads record events into their own ring
+// buffers without locks; a background thread drains the rings into the file.
+// When tracing is off, recording an event costs one predictable branch.
+static struct Tracer {
+  struct Ring {
+    enum {SIZE = 1 << 14};
+    struct Event {
+      const char *name;
+      char phase;
+      double timestamp;
+      unsigned long id;
+    } events[SIZE];
+    // head is advanced by the owning thread, tail by the flushing thread
+    unsigned head, tail;
+    unsigned dropped;
+    long tid;
+    char thread_name[32];
+    Ring *next;
+  };
+  FILE *file;
+  Ring *rings;
+  bool running, stopping;
+  pthread_t flusher;
+  pthread_mutex_t lock;
+
+  Tracer(): file(NULL), rings(NULL), running(false), stopping(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+  void open()
+  {
+    const char *path = getconf(PRIMUS_TRACE);
+    if (!*path)
+      return;
+    file = fopen(path, "w");
+    if (!file)
+      primus_warn("failed to open PRIMUS_TRACE: %s\n", strerror(errno));
+    else
+      fputs("{\"traceEvents\": [\n", file);
+  }
+  ~Tracer()
+  {
+    if (!file)
+      return;
+    if (running)
+    {
+      __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+      pthread_join(flusher, NULL);
+    }
+    flush();
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"primus\"}}\n]}\n", getpid());
+    fclose(file);
+    for (Ring *ring = rings; ring; ring = ring->next)
+      if (ring->dropped)
+	primus_warn("trace lost %u events of thread %ld\n", ring->dropped, ring->tid);
+    // Threads still running during exit stop recording
+    file = NULL;
+  }
+  // Called by the owning thread on its first event
+  Ring *add_ring(const char *thread_name)
+  {
+    Ring *ring = new Ring;
+    ring->head = ring->tail = ring->dropped = 0;
+    ring->tid = syscall(SYS_gettid);
+    snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", thread_name);
+    pthread_mutex_lock(&lock);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    if (!running)
+      running = !pthread_create(&flusher, NULL, flush_work, this);
+    pthread_mutex_unlock(&lock);
+    return ring;
+  }
+  static void record(Ring *ring, char phase, const char *name, unsigned long id)
+  {
+    unsigned head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == Ring::SIZE)
+    {
+      ring->dropped++;
+      return;
+    }
+    Ring::Event &e = ring->events[head % Ring::SIZE];
+    e.name = name;
+    e.phase = phase;
+    e.timestamp = get_time();
+    e.id = id;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  }
+  void flush()
+  {
+    int pid = getpid();
+    for (Ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+      unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (ring->tail == 0 && head)
+	fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %ld, \"args\": {\"name\": \"%s\"}},\n",
+		pid, ring->tid, ring->thread_name);
+      for (unsigned i = ring->tail; i != head; i++)
+      {
+	const Ring::Event &e = ring->events[i % Ring::SIZE];
+	fprintf(file, "{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %ld", e.name, e.phase, e.timestamp * 1e6, pid, ring->tid);
+	if (e.phase == 'i')
+	  fputs(", \"s\": \"t\"", file);
+	if (e.id)
+	  fprintf(file, ", \"args\": {\"drawable\": \"0x%lx\"}", e.id);
+	fputs("},\n", file);
+      }
+      __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+    fflush(file);
+  }
+  static void *flush_work(void *vself)
+  {
+    Tracer *self = (Tracer *)vself;
+    while (!__atomic_load_n(&self->stopping, __ATOMIC_ACQUIRE))
+    {
+      usleep(100000);
+      self->flush();
+    }
+    return NULL;
+  }
+} tracer;
+
+// Name under which the calling thread's events are shown
+static __thread const char *trace_thread_name = "app";
+static __thread Tracer::Ring *trace_ring;
+
+// Record a timeline event: 'B'egin or 'E'nd of a span, or 'i'nstant
+static inline void trace(char phase, const char *name, unsigned long id = 0)
+{
+  if (__builtin_expect(!tracer.file, 1))
+    return;
+  if (!trace_ring)
+    trace_ring = tracer.add_ring(trace_thread_name);
+  Tracer::record(trace_ring, phase, name, id);
+}
+
+// Span covering a scope
+struct TraceScope {
+  const char *name;
+  unsigned long id;
+  TraceScope(const char *name, unsigned long id = 0): name(name), id(id)
+  {
+    trace('B', name, id);
+  }
+  ~TraceScope()
+  {
+    trace('E', name, id);
+  }
+};
+
 // Profiler
 class Profiler {
-  const char *name;
+  char name[64];
   const char * const *state_names;
-  int nstates;
+  const char * const *counter_names;
+  const char * const *event_names;
+  int nstates, ncounters, nevents;
 
   int state;
   double *state_time;
+  double *counter_sum;
+  unsigned *event_count;
+  // Time spent in each state per frame, and swap-to-present latency
+  Histogram *state_hist, latency;
   double prev_timestamp, print_timestamp;
   int nframes;
 public:
-  Profiler(const char *name, const char * const *state_names):
-    name(name),
+  Profiler(const char *name, unsigned long id, const char * const *state_names,
+	   const char * const *counter_names = NULL, const char * const *event_names = NULL):
     state_names(state_names),
-    nstates(0), state(0), nframes(0)
+    counter_names(counter_names),
+    event_names(event_names),
+    nstates(0), ncounters(0), nevents(0), state(0), nframes(0)
   {
+    snprintf(this->name, sizeof(this->name), "%s 0x%lx", name, id);
     while (state_names[nstates]) ++nstates; // count number of states
+    while (counter_names && counter_names[ncounters]) ++ncounters;
+    while (event_names && event_names[nevents]) ++nevents;
     state_time = new double[nstates];
     memset(state_time, 0, sizeof(double)*nstates);
+    counter_sum = new double[ncounters];
+    memset(counter_sum, 0, sizeof(double)*ncounters);
+    event_count = new unsigned[nevents];
+    memset(event_count, 0, sizeof(unsigned)*nevents);
+    state_hist = new Histogram[nstates];
     // reset time data
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    double timestamp = tp.tv_sec + 1e-9 * tp.tv_nsec;
-    prev_timestamp = print_timestamp = timestamp;
+    prev_timestamp = print_timestamp = get_time();
   }
   ~Profiler()
   {
+    delete [] state_hist;
+    delete [] event_count;
+    delete [] counter_sum;
     delete [] state_time;
   }
+  // Accumulate a per-frame quantity; reported as average per frame
+  void count(int counter, double value)
+  {
+    counter_sum[counter] += value;
+  }
+  // Note an occurrence; reported as total count
+  void event(int idx)
+  {
+    event_count[idx]++;
+  }
+  // Note the time between a swap and the frame showing up on screen
+  void record_latency(double swap_timestamp, double present_timestamp)
+  {
+    latency.record(present_timestamp - swap_timestamp);
+  }
   void tick(bool state_reset = false)
   {
     // update times
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    double timestamp = tp.tv_sec + 1e-9 * tp.tv_nsec;
+    double timestamp = get_time();
     if (state_reset)
       state = 0;
     state_time[state] += timestamp - prev_timestamp;
+    state_hist[state].record(timestamp - prev_timestamp);
     state = (state + 1) % nstates;
     prev_timestamp = timestamp;
     nframes += !!(state == 0);
@@ -301,15 +1244,220 @@ public:
     double period = timestamp - print_timestamp; // time since we printed
     if (state != 0 || period < 5)
       return;
-    // construct output
-    char buf[64], *cbuf = buf, *end = buf+64;
-    for (int i = 0; i < nstates; i++)
-      cbuf += snprintf(cbuf, end - cbuf, ", %.1f%% %s", 100 * state_time[i] / period, state_names[i]);
-    primus_perf("%s: %.1f fps%s\n", name, nframes / period, buf);
+    if (primus.loglevel >= 2)
+      print(period);
+    if (profile_log.file)
+      log(timestamp, period);
     // start counting again
     print_timestamp = timestamp;
     nframes = 0;
     memset(state_time, 0, sizeof(double)*nstates);
+    memset(counter_sum, 0, sizeof(double)*ncounters);
+    memset(event_count, 0, sizeof(unsigned)*nevents);
+    for (int i = 0; i < nstates; i++)
+      state_hist[i].clear();
+    latency.clear();
+  }
+private:
+  static int print_hist(char *buf, char *end, const char *sep, const char *name, const Histogram &h)
+  {
+    return snprintf(buf, end - buf, "%s%s %.1f/%.1f/%.1f/%.1f", sep, name,
+		    h.percentile(.5), h.percentile(.95), h.percentile(.99), h.max * 1e3);
+  }
+  void print(double period)
+  {
+    // construct output
+    char buf[512], *cbuf = buf, *end = buf+512;
+    buf[0] = 0;
+    for (int i = 0; i < nstates && cbuf < end; i++)
+      cbuf += snprintf(cbuf, end - cbuf, ", %.1f%% %s", 100 * state_time[i] / period, state_names[i]);
+    for (int i = 0; i < ncounters && cbuf < end; i++)
+      cbuf += snprintf(cbuf, end - cbuf, ", %.1f %s", counter_sum[i] / nframes, counter_names[i]);
+    for (int i = 0; i < nevents && cbuf < end; i++)
+      cbuf += snprintf(cbuf, end - cbuf, ", %u %s", event_count[i], event_names[i]);
+    primus_perf("%s: %.1f fps%s\n", name, nframes / period, buf);
+    cbuf = buf;
+    for (int i = 0; i < nstates && cbuf < end; i++)
+      cbuf += print_hist(cbuf, end, i ? ", " : "", state_names[i], state_hist[i]);
+    if (latency.total && cbuf < end)
+      cbuf += print_hist(cbuf, end, ", ", "latency", latency);
+    primus_perf("%s: p50/p95/p99/max ms: %s\n", name, buf);
+  }
+  void log_hist(double timestamp, double fps, const char *metric, double value, const Histogram &h, bool last)
+  {
+    double p[4] = {h.percentile(.5), h.percentile(.95), h.percentile(.99), h.max * 1e3};
+    if (profile_log.json)
+      fprintf(profile_log.file, "\"%s\": {\"value\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s",
+	      metric, value, p[0], p[1], p[2], p[3], last ? "" : ", ");
+    else
+      fprintf(profile_log.file, "%.3f,%s,%.1f,%s,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+	      timestamp, name, fps, metric, value, p[0], p[1], p[2], p[3]);
+  }
+  void log_value(double timestamp, double fps, const char *metric, double value, bool last)
+  {
+    if (profile_log.json)
+      fprintf(profile_log.file, "\"%s\": %.3f%s", metric, value, last ? "" : ", ");
+    else
+      fprintf(profile_log.file, "%.3f,%s,%.1f,%s,%.3f,,,,\n", timestamp, name, fps, metric, value);
+  }
+  // States are reported with percentage of time, latency with the mean
+  void log(double timestamp, double period)
+  {
+    double fps = nframes / period;
+    pthread_mutex_lock(&profile_log.lock);
+    if (profile_log.json)
+      fprintf(profile_log.file, "{\"time\": %.3f, \"profiler\": \"%s\", \"fps\": %.1f, \"states\": {",
+	      timestamp, name, fps);
+    for (int i = 0; i < nstates; i++)
+      log_hist(timestamp, fps, state_names[i], 100 * state_time[i] / period, state_hist[i], i == nstates - 1);
+    if (profile_log.json)
+      fputs("}, \"counters\": {", profile_log.file);
+    for (int i = 0; i < ncounters; i++)
+      log_value(timestamp, fps, counter_names[i], counter_sum[i] / nframes, i == ncounters - 1);
+    if (profile_log.json)
+      fputs("}, \"events\": {", profile_log.file);
+    for (int i = 0; i < nevents; i++)
+      log_value(timestamp, fps, event_names[i], event_count[i], i == nevents - 1);
+    if (profile_log.json)
+      fputs("}", profile_log.file);
+    if (latency.total)
+    {
+      if (profile_log.json)
+	fputs(", ", profile_log.file);
+      log_hist(timestamp, fps, "latency", latency.sum * 1e3 / latency.total, latency, true);
+    }
+    if (profile_log.json)
+      fputs("}\n", profile_log.file);
+    fflush(profile_log.file);
+    pthread_mutex_unlock(&profile_log.lock);
+  }
+};
+
+// Vector of four 32-bit lanes; GCC lowers operations on it to SSE2 or NEON
+typedef unsigned v4si __attribute__((vector_size(16)));
+
+static inline v4si load_v4si(const char *p)
+{
+  v4si v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline v4si hash_mix(v4si h, v4si v)
+{
+  const v4si k = {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f};
+  h = (h ^ v) * k;
+  return h ^ (h >> 15);
+}
+
+// Hash a run of bytes into four independent accumulators
+static void hash_bytes(v4si h[4], const char *p, int n)
+{
+  int i = 0;
+  for (; i + 64 <= n; i += 64)
+    for (int j = 0; j < 4; j++)
+      h[j] = hash_mix(h[j], load_v4si(p + i + 16 * j));
+  for (int j = 0; i + 16 <= n; i += 16, j++)
+    h[j] = hash_mix(h[j], load_v4si(p + i));
+  if (i < n)
+  {
+    v4si v = {0};
+    memcpy(&v, p + i, n - i);
+    h[3] = hash_mix(h[3], v);
+  }
+}
+
+// Tracks which tiles of frames changed since the previous frame by
+// keeping a hash of each tile.  A hash collision may leave a tile stale on
+// screen until its contents change again.
+struct TileDiff: TileGrid {
+  v4si *hashes, *scratch;
+  // Tiles changed since the last take()
+  unsigned char *changed;
+  int nchanged;
+
+  TileDiff(): hashes(NULL), scratch(NULL), changed(NULL), nchanged(0)
+  {
+    init(0, 0, 0);
+  }
+  ~TileDiff()
+  {
+    release();
+  }
+  // Set up for frames of the given size; all tiles are initially changed
+  void reset(int tile_size, int width, int height)
+  {
+    release();
+    init(tile_size, width, height);
+    if (tile_size > 0)
+    {
+      hashes = new v4si[4 * ntiles()];
+      scratch = new v4si[4 * cols];
+      memset(hashes, 0, 4 * ntiles() * sizeof(v4si));
+    }
+    changed = new unsigned char[ntiles()];
+    memset(changed, 1, ntiles());
+    nchanged = ntiles();
+  }
+  // Mark tiles of the new frame that differ from the previous frame; with
+  // rect (x, y, width, height), only tiles overlapping it are compared
+  void update(const char *pixels, const int *rect = NULL)
+  {
+    if (!hashes)
+    {
+      memset(changed, 1, ntiles());
+      nchanged = ntiles();
+      return;
+    }
+    v4si *cur = scratch;
+    const int bytes = primus.format->bytes;
+    int tx0 = 0, ty0 = 0, tx1 = cols, ty1 = rows;
+    if (rect)
+    {
+      tx0 = rect[0] / size;
+      ty0 = rect[1] / size;
+      tx1 = (rect[0] + rect[2] + size - 1) / size;
+      ty1 = (rect[1] + rect[3] + size - 1) / size;
+    }
+    for (int ty = ty0; ty < ty1; ty++)
+    {
+      for (int i = 0; i < 4 * cols; i++)
+	cur[i] = (v4si){0x243f6a88, 0x85a308d3, 0x13198a2e, (unsigned)i};
+      int yend = (ty + 1) * size < height ? (ty + 1) * size : height;
+      for (int y = ty * size; y < yend; y++)
+	for (int tx = tx0, x = tx0 * size; tx < tx1; tx++, x += size)
+	{
+	  int n = (x + size < width ? size : width - x) * bytes;
+	  hash_bytes(&cur[4 * tx], pixels + (y * width + x) * bytes, n);
+	}
+      for (int tx = tx0; tx < tx1; tx++)
+      {
+	v4si *h = &hashes[4 * (ty * cols + tx)];
+	if (!memcmp(h, &cur[4 * tx], 4 * sizeof(v4si)))
+	  continue;
+	memcpy(h, &cur[4 * tx], 4 * sizeof(v4si));
+	nchanged += !changed[ty * cols + tx];
+	changed[ty * cols + tx] = 1;
+      }
+    }
+  }
+  // Hand out the tiles changed since the last call, returning their number
+  int take(unsigned char *out)
+  {
+    int n = nchanged;
+    memcpy(out, changed, ntiles());
+    memset(changed, 0, ntiles());
+    nchanged = 0;
+    return n;
+  }
+private:
+  void release()
+  {
+    delete[] hashes;
+    delete[] scratch;
+    delete[] changed;
+    hashes = scratch = NULL;
+    changed = NULL;
   }
 };
 
@@ -322,172 +1470,1894 @@ static void note_geometry(Display *dpy, Drawable draw, int *width, int *height)
   XGetGeometry(dpy, draw, &root, &x, &y, (unsigned *)width, (unsigned *)height, &bw, &d);
 }
 
-static void* display_work(void *vd)
+// return the parent of the given X window
+static Window get_parent(Display *dpy, Window w)
 {
-  GLXDrawable drawable = (GLXDrawable)vd;
-  DrawableInfo &di = primus.drawables[drawable];
-  int width, height;
-  static const float quad_vertex_coords[]  = {-1, -1, -1, 1, 1, 1, 1, -1};
-	       float quad_texture_coords[] = { 0,  0,  0, 1, 1, 1, 1,  0};
-  GLuint textures[2] = {0};
-  int ctex = 0;
-  static const char *state_names[] = {"wait", "upload", "draw+swap", NULL};
-  Profiler profiler("display", state_names);
-  Display *ddpy = XOpenDisplay(NULL);
-  assert(di.kind == di.XWindow || di.kind == di.Window);
-  XSelectInput(ddpy, di.window, StructureNotifyMask);
-  note_geometry(ddpy, di.window, &width, &height);
-  if (di.width != width || di.height != height) {
-    di.reinit = di.RESIZE; di.width = width; di.height = height;
-  }
-  GLXContext context = primus.dfns.glXCreateNewContext(ddpy, primus.dconfigs[0], GLX_RGBA_TYPE, NULL, True);
-  die_if(!primus.dfns.glXIsDirect(ddpy, context),
-	 "failed to acquire direct rendering context for display thread\n");
-  primus.dfns.glXMakeCurrent(ddpy, di.window, context);
-  primus.dfns.glVertexPointer  (2, GL_FLOAT, 0, quad_vertex_coords);
-  primus.dfns.glTexCoordPointer(2, GL_FLOAT, 0, quad_texture_coords);
-  primus.dfns.glEnableClientState(GL_VERTEX_ARRAY);
-  primus.dfns.glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-  primus.dfns.glGenTextures(2, textures);
-  primus.dfns.glEnable(GL_TEXTURE_RECTANGLE);
-  for (;;)
+  Window root, parent, *children;
+  unsigned int nchildren;
+  XQueryTree(dpy, w, &root, &parent, &children, &nchildren);
+  XFree(children);
+  return parent;
+}
+
+// Disable compositing as long as the window containing this drawable is open:
+// set the property on all windows up to, but excluding, the root.  Display
+// workers do this on their own connection, so that the application does not
+// wait for a round trip per level of nesting.
+static void block_compositing(Display *dpy, Window window)
+{
+  static Atom atom;
+  Atom block = __atomic_load_n(&atom, __ATOMIC_RELAXED);
+  if (!block)
   {
-    sem_wait(&di.d.acqsem);
-    profiler.tick(true);
-    if (di.d.reinit)
+    // Atoms are global to the server, so one lookup serves all connections
+    block = XInternAtom(dpy, "_KDE_NET_WM_BLOCK_COMPOSITING", False);
+    __atomic_store_n(&atom, block, __ATOMIC_RELAXED);
+  }
+  for (Window cur = window, parent; (parent = get_parent(dpy, cur)); cur = parent)
+    XChangeProperty(dpy, cur, block, XA_ATOM, 32, PropModeReplace, NULL, 0);
+}
+
+// Check for name in a space-separated list of extensions
+static bool has_extension(const char *exts, const char *name)
+{
+  size_t len = strlen(name);
+  for (const char *p = exts; p && (p = strstr(p, name)); p += len)
+    if ((p == exts || p[-1] == ' ') && (p[len] == ' ' || !p[len]))
+      return true;
+  return false;
+}
+
+// Upload a rectangle of the frame into the bound texture, or with staging,
+// only copy it there at its offset in the frame.  NULL pixels refer to the
+// bound pixel unpack buffer.
+static void upload_rect(const TileGrid &tiles, const char *pixels, char *staging, int x, int y, int w, int h)
+{
+  const TransferFormat &fmt = *primus.format;
+  size_t offset = (y * tiles.width + x) * fmt.bytes, stride = tiles.width * fmt.bytes;
+  if (!staging)
+    primus.dfns.glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, x, y, w, h, fmt.format, fmt.type,
+				pixels ? (const GLvoid *)(pixels + offset) : (const GLvoid *)offset);
+  else if (w == tiles.width)
+    memcpy(staging + offset, pixels + offset, h * stride);
+  else
+    for (int i = 0; i < h; i++)
+      memcpy(staging + offset + i * stride, pixels + offset + i * stride, w * fmt.bytes);
+}
+
+// Upload stale tiles of the frame into the bound texture, merging adjacent
+// tiles in a row, and clear them in stale; returns the number of tiles
+// uploaded.  With staging, only copy the tiles there, leaving stale as is.
+static int upload_tiles(const TileGrid &tiles, unsigned char *stale, const char *pixels, char *staging = NULL)
+{
+  int nstale = 0, ntiles = tiles.ntiles();
+  for (int i = 0; i < ntiles; i++)
+    nstale += stale[i];
+  if (nstale * 4 >= ntiles * 3)
+  {
+    // Mostly changed: a single upload is cheaper than many small ones
+    upload_rect(tiles, pixels, staging, 0, 0, tiles.width, tiles.height);
+    if (!staging)
+      memset(stale, 0, ntiles);
+    return nstale;
+  }
+  for (int ty = 0; ty < tiles.rows; ty++)
+  {
+    unsigned char *row = stale + ty * tiles.cols;
+    int y = ty * tiles.size, h = y + tiles.size < tiles.height ? tiles.size : tiles.height - y;
+    for (int tx = 0; tx < tiles.cols; tx++)
+    {
+      if (!row[tx])
+	continue;
+      int tend = tx;
+      while (tend < tiles.cols && row[tend])
+	if (staging)
+	  tend++;
+	else
+	  row[tend++] = 0;
+      int x = tx * tiles.size, w = (tend * tiles.size < tiles.width ? tend * tiles.size : tiles.width) - x;
+      upload_rect(tiles, pixels, staging, x, y, w, h);
+      tx = tend;
+    }
+  }
+  return nstale;
+}
+
+// Means of putting frames on the application's window.  Frames are copied
+// into one of several buffers, which is then shown on the window; the display
+// worker tracks which tiles each buffer lacks.
+struct DisplayBackend {
+  virtual ~DisplayBackend() {}
+  // (Re)allocate buffers for frames of the given size
+  virtual void resize(int width, int height) = 0;
+  // Copy stale tiles of the frame into the buffer and clear them in stale;
+  // returns the number of tiles copied
+  virtual int upload(int buf, const TileGrid &tiles, unsigned char *stale, const char *pixels) = 0;
+  // Show the buffer; changed tiles differ from what is on screen (NULL: all).
+  // The frame was swapped by the application at swap_time.
+  virtual void present(int buf, const TileGrid &tiles, const unsigned char *changed, double swap_time) = 0;
+  // Whether completion() tells when frames reach the screen; otherwise they
+  // are taken to do so once presented
+  virtual bool has_feedback()
+  {
+    return false;
+  }
+  // Take a frame that reached the screen: its swap time, and when it was
+  // shown; returns false if there is none
+  virtual bool completion(double *swap_time, double *shown_time)
+  {
+    return false;
+  }
+  // Prepare for working on this backend's window
+  virtual void activate() {}
+  // Scale frames to this size when presenting, if supported
+  virtual void set_output_size(int width, int height) {}
+  // Wait for this many vertical blanks between presents, if supported
+  virtual void set_swap_interval(int interval) {}
+  // Refresh period of the window's screen in seconds; 0: unknown
+  virtual double refresh_period()
+  {
+    return 0;
+  }
+  // Consume an event meant for the backend
+  virtual bool handle_event(const XEvent &event)
+  {
+    return false;
+  }
+};
+
+// Draw a textured quad using an OpenGL context on the displaying libGL, shared
+// by all windows of a display worker.  Frames are staged through pixel unpack
+// buffers, one per texture, so that the readback buffer is released as soon as
+// the CPU copy is done and the texture upload proceeds asynchronously; with
+// ARB_buffer_storage, they are mapped persistently and reuse is guarded by
+// fences.
+struct GLBackend: DisplayBackend {
+  Display *dpy;
+  GLXContext context;
+  Window window;
+  int nbufs;
+  GLuint *textures;
+  bool persistent;
+  struct Staging {
+    GLuint pbo;
+    char *data; // persistent mapping
+    GLsync fence;
+  } *staging;
+  GLsizeiptr size;
+  int width, height, out_width, out_height;
+  float quad_texture_coords[8];
+
+  GLBackend(Display *dpy, Window window, int nbufs, GLXContext context):
+    dpy(dpy), context(context), window(window), nbufs(nbufs), textures(new GLuint[nbufs]),
+    staging(new Staging[nbufs]()), size(0), width(0), height(0), out_width(0), out_height(0)
+  {
+    static const float unit_texture_coords[] = { 0,  0,  0, 1, 1, 1, 1,  0};
+    memcpy(quad_texture_coords, unit_texture_coords, sizeof(quad_texture_coords));
+    activate();
+    persistent = has_extension((const char *)primus.dfns.glGetString(GL_EXTENSIONS), "GL_ARB_buffer_storage");
+    primus.dfns.glEnableClientState(GL_VERTEX_ARRAY);
+    primus.dfns.glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    primus.dfns.glGenTextures(nbufs, textures);
+    for (int i = 0; i < nbufs; i++)
+      primus.dfns.glGenBuffers(1, &staging[i].pbo);
+    primus.dfns.glEnable(GL_TEXTURE_RECTANGLE);
+    primus.dfns.glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  }
+  // The window may be destroyed already, so objects are freed with whatever
+  // drawable the shared context is bound to; if it is not current, they go
+  // away with the context
+  ~GLBackend()
+  {
+    if (primus.dfns.glXGetCurrentContext() == context)
+    {
+      release_staging();
+      for (int i = 0; i < nbufs; i++)
+	primus.dfns.glDeleteBuffers(1, &staging[i].pbo);
+      primus.dfns.glDeleteTextures(nbufs, textures);
+    }
+    delete[] staging;
+    delete[] textures;
+  }
+  void activate()
+  {
+    static const float quad_vertex_coords[]  = {-1, -1, -1, 1, 1, 1, 1, -1};
+    primus.dfns.glXMakeCurrent(dpy, window, context);
+    primus.dfns.glViewport(0, 0, out_width, out_height);
+    primus.dfns.glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+    primus.dfns.glVertexPointer  (2, GL_FLOAT, 0, quad_vertex_coords);
+    primus.dfns.glTexCoordPointer(2, GL_FLOAT, 0, quad_texture_coords);
+  }
+  // Frames fill the lower left part of textures
+  void set_frame_size(int width, int height)
+  {
+    if (width == this->width && height == this->height)
+      return;
+    this->width = width;
+    this->height = height;
+    update_texture_coords();
+    primus.dfns.glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+  }
+  void set_output_size(int width, int height)
+  {
+    out_width = width;
+    out_height = height;
+    update_texture_coords();
+    primus.dfns.glViewport(0, 0, width, height);
+  }
+  // Map the centers of the outermost pixels of the window to those of the
+  // frame, so that filtering never blends in texels beyond the frame; at equal
+  // sizes this maps the quad to the frame exactly
+  void update_texture_coords()
+  {
+    float kx = out_width > 1 ? (width - 1.f) / (out_width - 1) : 1;
+    float ky = out_height > 1 ? (height - 1.f) / (out_height - 1) : 1;
+    quad_texture_coords[0] = quad_texture_coords[2] = .5f - .5f * kx;
+    quad_texture_coords[1] = quad_texture_coords[7] = .5f - .5f * ky;
+    quad_texture_coords[4] = quad_texture_coords[6] = .5f + (out_width - .5f) * kx;
+    quad_texture_coords[3] = quad_texture_coords[5] = .5f + (out_height - .5f) * ky;
+  }
+  void release_staging()
+  {
+    for (int i = 0; i < nbufs; i++)
+    {
+      Staging &s = staging[i];
+      if (s.fence)
+	primus.dfns.glDeleteSync(s.fence);
+      s.fence = 0;
+      if (s.data)
+      {
+	primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s.pbo);
+	primus.dfns.glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      }
+      s.data = NULL;
+    }
+    primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  void resize(int width, int height)
+  {
+    for (int i = 0; i < nbufs; i++)
+    {
+      primus.dfns.glBindTexture(GL_TEXTURE_RECTANGLE, textures[i]);
+      primus.dfns.glTexImage2D(GL_TEXTURE_RECTANGLE, 0, primus.format->bytes == 4 ? GL_RGBA : GL_RGB, width, height, 0,
+			       primus.format->format, primus.format->type, NULL);
+      // Scaled frames are upscaled bilinearly
+      primus.dfns.glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      primus.dfns.glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    release_staging();
+    size = (GLsizeiptr)width * height * primus.format->bytes;
+    for (int i = 0; i < nbufs && persistent; i++)
     {
-      if (di.d.reinit == di.SHUTDOWN)
+      // Buffer storage is immutable, so get a fresh buffer
+      const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      Staging &s = staging[i];
+      primus.dfns.glDeleteBuffers(1, &s.pbo);
+      primus.dfns.glGenBuffers(1, &s.pbo);
+      primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s.pbo);
+      primus.dfns.glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+      s.data = (char *)primus.dfns.glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+      die_if(!s.data, "failed to map upload buffer persistently\n");
+    }
+    primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  int upload(int buf, const TileGrid &tiles, unsigned char *stale, const char *pixels)
+  {
+    Staging &s = staging[buf];
+    char *data = s.data;
+    set_frame_size(tiles.width, tiles.height);
+    primus.dfns.glBindTexture(GL_TEXTURE_RECTANGLE, textures[buf]);
+    primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s.pbo);
+    if (persistent)
+    {
+      // Previous upload from this buffer must have been consumed
+      if (s.fence)
       {
-	primus.dfns.glDeleteTextures(2, textures);
-	primus.dfns.glXMakeCurrent(ddpy, 0, NULL);
-	primus.dfns.glXDestroyContext(ddpy, context);
-	XCloseDisplay(ddpy);
-	sem_post(&di.d.relsem);
+	primus.dfns.glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	primus.dfns.glDeleteSync(s.fence);
+      }
+    }
+    else
+    {
+      // Orphan previous storage rather than wait for the driver to release it
+      primus.dfns.glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+      data = (char *)primus.dfns.glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    }
+    if (!data)
+    {
+      primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      return upload_tiles(tiles, stale, pixels);
+    }
+    // Copy stale tiles, then upload them from the buffer
+    upload_tiles(tiles, stale, pixels, data);
+    if (!persistent)
+      primus.dfns.glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    int n = upload_tiles(tiles, stale, NULL);
+    if (persistent)
+      s.fence = primus.dfns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    primus.dfns.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return n;
+  }
+  void present(int buf, const TileGrid &tiles, const unsigned char *changed, double swap_time)
+  {
+    set_frame_size(tiles.width, tiles.height);
+    primus.dfns.glBindTexture(GL_TEXTURE_RECTANGLE, textures[buf]);
+    primus.dfns.glDrawArrays(GL_QUADS, 0, 4);
+    primus.dfns.glXSwapBuffers(dpy, window);
+  }
+  // MESA and SGI variants apply to the current drawable, which is the window
+  void set_swap_interval(int interval)
+  {
+    const char *exts = primus.dfns.glXQueryExtensionsString(dpy, 0);
+    if (has_extension(exts, "GLX_EXT_swap_control"))
+      primus.dfns.glXSwapIntervalEXT(dpy, window, interval);
+    else if (has_extension(exts, "GLX_MESA_swap_control"))
+      primus.dfns.glXSwapIntervalMESA(interval);
+    else if (interval > 0 && has_extension(exts, "GLX_SGI_swap_control"))
+      primus.dfns.glXSwapIntervalSGI(interval);
+  }
+  double refresh_period()
+  {
+    int32_t num, den;
+    if (!has_extension(primus.dfns.glXQueryExtensionsString(dpy, 0), "GLX_OML_sync_control") ||
+	!primus.dfns.glXGetMscRateOML(dpy, window, &num, &den) || num <= 0)
+      return 0;
+    return (double)den / num;
+  }
+};
+
+// Helper threads taking parts of large copies off the display worker
+struct CopyTeam {
+  typedef void (*Job)(void *arg, int part, int nparts);
+  int nhelpers;
+  struct Helper {
+    CopyTeam *team;
+    int part;
+    pthread_t thread;
+  } *helpers;
+  sem_t start, done;
+  Job job;
+  void *arg;
+
+  CopyTeam(int nhelpers): nhelpers(nhelpers), helpers(new Helper[nhelpers]), job(NULL)
+  {
+    sem_init(&start, 0, 0);
+    sem_init(&done, 0, 0);
+    for (int i = 0; i < nhelpers; i++)
+    {
+      helpers[i].team = this;
+      helpers[i].part = i + 1;
+      pthread_create(&helpers[i].thread, NULL, work, &helpers[i]);
+    }
+  }
+  ~CopyTeam()
+  {
+    run(NULL, NULL);
+    for (int i = 0; i < nhelpers; i++)
+      pthread_join(helpers[i].thread, NULL);
+    delete[] helpers;
+    sem_destroy(&done);
+    sem_destroy(&start);
+  }
+  // Run job on all parts, taking part 0 on the calling thread; NULL job
+  // terminates helpers
+  void run(Job job, void *arg)
+  {
+    this->job = job;
+    this->arg = arg;
+    for (int i = 0; i < nhelpers; i++)
+      sem_post(&start);
+    if (job)
+      job(arg, 0, nhelpers + 1);
+    for (int i = 0; i < nhelpers; i++)
+      while (sem_wait(&done) && errno == EINTR);
+  }
+private:
+  static void *work(void *vhelper)
+  {
+    Helper *helper = (Helper *)vhelper;
+    CopyTeam *team = helper->team;
+    for (;;)
+    {
+      while (sem_wait(&team->start) && errno == EINTR);
+      Job job = team->job;
+      if (job)
+	job(team->arg, helper->part, team->nhelpers + 1);
+      sem_post(&team->done);
+      if (!job)
 	return NULL;
+    }
+  }
+};
+
+// Vector of eight 16-bit lanes, for narrowing 32-bit pixels
+typedef unsigned short v8hi __attribute__((vector_size(16)));
+
+// BGRA word for pixel i of a run in a transfer format of the given size
+template<int bytes>
+static inline unsigned load_pixel(const char *src, int i)
+{
+  unsigned p;
+  unsigned short v;
+  const unsigned char *b = (const unsigned char *)src + 3 * i;
+  switch (bytes)
+  {
+    case 3:
+      return b[0] | b[1] << 8 | b[2] << 16;
+    case 2:
+      memcpy(&v, src + 2 * i, 2);
+      p = v >> 11 << 19 | (v >> 5 & 63) << 10 | (v & 31) << 3;
+      return p | (p >> 5 & 0x070007) | (p >> 6 & 0x300);
+    default:
+      memcpy(&p, src + 4 * i, 4);
+      return p;
+  }
+}
+
+// Conversion from frames in the transfer format (BGRA: as 32-bit words) to
+// the pixel format of an X visual with up to 32 bits per pixel
+struct PixelConverter {
+  int bpp;
+  bool identity, vector;
+  bool direct, msb_first; // pixels stored bytewise, in the image's byte order
+  unsigned rshift[3], cmask[3], lshift[3];
+
+  void init(const Visual *visual, const XImage *image)
+  {
+    static const unsigned one = 1;
+    const int host_order = *(const char *)&one ? LSBFirst : MSBFirst;
+    const unsigned long masks[3] = {visual->red_mask, visual->green_mask, visual->blue_mask};
+    const int src_shift[3] = {16, 8, 0};
+    bpp = image->bits_per_pixel;
+    identity = bpp == 32 && image->byte_order == host_order;
+    for (int c = 0; c < 3; c++)
+    {
+      int ds = __builtin_ctzl(masks[c]), n = __builtin_popcountl(masks[c]);
+      rshift[c] = n <= 8 ? src_shift[c] + 8 - n : src_shift[c];
+      cmask[c] = n <= 8 ? (1u << n) - 1 : 0xff;
+      lshift[c] = n <= 8 ? ds : ds + n - 8;
+      identity &= n == 8 && ds == src_shift[c];
+    }
+    vector = (bpp == 16 || bpp == 32) && image->byte_order == host_order;
+    direct = bpp == 16 || bpp == 24 || bpp == 32;
+    msb_first = image->byte_order == MSBFirst;
+    identity &= primus.format->bytes == 4;
+    vector &= primus.format->bytes == 4;
+  }
+  unsigned convert(unsigned p) const
+  {
+    return ((p >> rshift[0]) & cmask[0]) << lshift[0]
+	 | ((p >> rshift[1]) & cmask[1]) << lshift[1]
+	 | ((p >> rshift[2]) & cmask[2]) << lshift[2];
+  }
+  v4si convert(v4si p) const
+  {
+    return ((p >> rshift[0]) & cmask[0]) << lshift[0]
+	 | ((p >> rshift[1]) & cmask[1]) << lshift[1]
+	 | ((p >> rshift[2]) & cmask[2]) << lshift[2];
+  }
+  // Convert a run of n pixels into row y of the image, starting at column x
+  void convert_run(XImage *image, int x, int y, const char *src, int n) const
+  {
+    char *dst = image->data + y * image->bytes_per_line + x * bpp / 8;
+    if (identity)
+      return (void)memcpy(dst, src, n * 4);
+    int i = 0;
+    if (vector && bpp == 32)
+      for (; i + 4 <= n; i += 4)
+      {
+	v4si v = convert(load_v4si(src + 4 * i));
+	memcpy(dst + 4 * i, &v, sizeof(v));
       }
-      di.d.reinit = di.NONE;
-      quad_texture_coords[4] = quad_texture_coords[6] = width = di.width;
-      quad_texture_coords[3] = quad_texture_coords[5] = height = di.height;
-      primus.dfns.glViewport(0, 0, width, height);
-      primus.dfns.glBindTexture(GL_TEXTURE_RECTANGLE, textures[ctex ^ 1]);
-      primus.dfns.glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
-      primus.dfns.glBindTexture(GL_TEXTURE_RECTANGLE, textures[ctex]);
-      primus.dfns.glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
-      sem_post(&di.d.relsem);
-      continue;
+    else if (vector)
+      for (; i + 8 <= n; i += 8)
+      {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const v8hi low_halves = {0, 2, 4, 6, 8, 10, 12, 14};
+#else
+	const v8hi low_halves = {1, 3, 5, 7, 9, 11, 13, 15};
+#endif
+	v4si a = convert(load_v4si(src + 4 * i)), b = convert(load_v4si(src + 4 * i + 16));
+	v8hi v = __builtin_shuffle((v8hi)a, (v8hi)b, low_halves);
+	memcpy(dst + 2 * i, &v, sizeof(v));
+      }
+    switch (primus.format->bytes)
+    {
+      case 3: return convert_tail<3>(image, x, y, dst, src, i, n);
+      case 2: return convert_tail<2>(image, x, y, dst, src, i, n);
+      default: return convert_tail<4>(image, x, y, dst, src, i, n);
+    }
+  }
+  // Convert pixels i to n of a run; XPutPixel is left for layouts other than
+  // 16, 24 and 32 bits per pixel
+  template<int bytes>
+  void convert_tail(XImage *image, int x, int y, char *dst, const char *src, int i, int n) const
+  {
+    unsigned char *d = (unsigned char *)dst + i * (bpp / 8);
+    switch (direct ? bpp : 0)
+    {
+      case 32:
+	for (; i < n; i++, d += 4)
+	  store(d, convert(load_pixel<bytes>(src, i)), 4);
+	break;
+      case 24:
+	for (; i < n; i++, d += 3)
+	  store(d, convert(load_pixel<bytes>(src, i)), 3);
+	break;
+      case 16:
+	for (; i < n; i++, d += 2)
+	  store(d, convert(load_pixel<bytes>(src, i)), 2);
+	break;
+      default:
+	for (; i < n; i++)
+	  XPutPixel(image, x + i, y, convert(load_pixel<bytes>(src, i)));
     }
-    primus.dfns.glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, di.pixeldata);
-    if (!primus.sync)
-      sem_post(&di.d.relsem); // Unlock as soon as possible
+  }
+  // Store the low n bytes of a pixel in the image's byte order
+  void store(unsigned char *d, unsigned p, int n) const
+  {
+    for (int k = 0; k < n; k++)
+      d[msb_first ? n - 1 - k : k] = p >> 8 * k;
+  }
+};
+
+// Put frames on the window with XShmPutImage, without involving the
+// displaying libGL; frames are converted to the window's visual on the CPU
+struct ShmBackend: DisplayBackend {
+  Display *dpy;
+  Window window;
+  GC gc;
+  XWindowAttributes attrs;
+  int completion_type;
+  int nbufs, width, height;
+  struct Buffer {
+    XImage *image;
+    XShmSegmentInfo shminfo;
+    bool busy; // the server may still be reading it
+  } *bufs;
+  PixelConverter converter;
+  CopyTeam *team; // of the display worker; NULL: copy alone
+  // Current copy job, split by rows among the team
+  struct Span {
+    int x, y, w, h;
+  } *spans;
+  int nspans, maxspans;
+  XImage *target;
+  const char *source;
+
+  ShmBackend(Display *dpy, Window window, int nbufs, CopyTeam *team):
+    dpy(dpy), window(window), nbufs(nbufs), width(0), height(0),
+    bufs(new Buffer[nbufs]()), team(team), spans(NULL), maxspans(0)
+  {
+    XGetWindowAttributes(dpy, window, &attrs);
+    gc = XCreateGC(dpy, window, 0, NULL);
+    completion_type = XShmGetEventBase(dpy) + ShmCompletion;
+  }
+  ~ShmBackend()
+  {
+    release();
+    delete[] bufs;
+    delete[] spans;
+    XFreeGC(dpy, gc);
+  }
+  void release()
+  {
+    for (int i = 0; i < nbufs; i++)
+      if (bufs[i].image)
+      {
+	wait_idle(i);
+	XShmDetach(dpy, &bufs[i].shminfo);
+	XDestroyImage(bufs[i].image);
+	shmdt(bufs[i].shminfo.shmaddr);
+	bufs[i].image = NULL;
+      }
+    XSync(dpy, False);
+  }
+  void resize(int width, int height)
+  {
+    release();
+    for (int i = 0; i < nbufs; i++)
+    {
+      Buffer &b = bufs[i];
+      b.image = XShmCreateImage(dpy, attrs.visual, attrs.depth, ZPixmap, NULL, &b.shminfo, width, height);
+      die_if(!b.image, "failed to create MIT-SHM image\n");
+      b.shminfo.shmid = shmget(IPC_PRIVATE, b.image->bytes_per_line * height, IPC_CREAT | 0600);
+      die_if(b.shminfo.shmid < 0, "failed to allocate shared memory: %s\n", strerror(errno));
+      b.shminfo.shmaddr = b.image->data = (char *)shmat(b.shminfo.shmid, NULL, 0);
+      b.shminfo.readOnly = True;
+      XShmAttach(dpy, &b.shminfo);
+      b.busy = false;
+    }
+    XSync(dpy, False);
+    // The segments are destroyed once both processes detach
+    for (int i = 0; i < nbufs; i++)
+      shmctl(bufs[i].shminfo.shmid, IPC_RMID, NULL);
+    converter.init(attrs.visual, bufs[0].image);
+  }
+  // Whether the event tells that the server is done with a buffer
+  virtual bool is_release(const XEvent &event)
+  {
+    return event.type == completion_type && event.xany.window == window;
+  }
+  static Bool is_completion(Display *dpy, XEvent *event, XPointer vself)
+  {
+    return ((ShmBackend *)vself)->is_release(*event);
+  }
+  bool handle_event(const XEvent &event)
+  {
+    if (event.type != completion_type)
+      return false;
+    ShmSeg seg = ((const XShmCompletionEvent *)&event)->shmseg;
+    for (int i = 0; i < nbufs; i++)
+      if (bufs[i].shminfo.shmseg == seg)
+	bufs[i].busy = false;
+    return true;
+  }
+  void wait_idle(int buf)
+  {
+    XEvent event;
+    while (bufs[buf].busy)
+    {
+      XIfEvent(dpy, &event, is_completion, (XPointer)this);
+      bool cookie = event.type == GenericEvent && XGetEventData(dpy, &event.xcookie);
+      handle_event(event);
+      if (cookie)
+	XFreeEventData(dpy, &event.xcookie);
+    }
+  }
+  // Collect runs of flagged tiles as rectangles in image coordinates
+  int collect_spans(const TileGrid &tiles, const unsigned char *flags, unsigned char *clear)
+  {
+    if (maxspans < tiles.ntiles() + 1)
+    {
+      delete[] spans;
+      spans = new Span[maxspans = tiles.ntiles() + 1];
+    }
+    int n = 0;
+    for (int ty = 0; ty < tiles.rows; ty++)
+    {
+      int y = ty * tiles.size, h = y + tiles.size < tiles.height ? tiles.size : tiles.height - y;
+      for (int tx = 0; tx < tiles.cols; tx++)
+      {
+	if (!flags[ty * tiles.cols + tx])
+	  continue;
+	int tend = tx;
+	while (tend < tiles.cols && flags[ty * tiles.cols + tend])
+	{
+	  if (clear)
+	    clear[ty * tiles.cols + tend] = 0;
+	  tend++;
+	}
+	int x = tx * tiles.size, w = (tend * tiles.size < tiles.width ? tend * tiles.size : tiles.width) - x;
+	spans[n++] = (Span){x, tiles.height - y - h, w, h};
+	tx = tend;
+      }
+    }
+    return n;
+  }
+  static void copy_job(void *vself, int part, int nparts)
+  {
+    ShmBackend *self = (ShmBackend *)vself;
+    for (int i = 0; i < self->nspans; i++)
+    {
+      const Span &s = self->spans[i];
+      // Frames are stored bottom-up, images top-down
+      for (int y = s.y + s.h * part / nparts; y < s.y + s.h * (part + 1) / nparts; y++)
+	self->converter.convert_run(self->target, s.x, y,
+				    self->source + ((self->height - 1 - y) * self->width + s.x) * primus.format->bytes, s.w);
+    }
+  }
+  int upload(int buf, const TileGrid &tiles, unsigned char *stale, const char *pixels)
+  {
+    int nstale = 0;
+    for (int i = 0; i < tiles.ntiles(); i++)
+      nstale += stale[i];
+    wait_idle(buf);
+    // Frames fill the upper left part of images
+    width = tiles.width;
+    height = tiles.height;
+    nspans = collect_spans(tiles, stale, stale);
+    target = bufs[buf].image;
+    source = pixels;
+    long npixels = 0;
+    for (int i = 0; i < nspans; i++)
+      npixels += spans[i].w * spans[i].h;
+    // Splitting small copies is not worth waking up helpers
+    if (team && npixels >= 1 << 20)
+      team->run(copy_job, this);
+    else
+      copy_job(this, 0, 1);
+    return nstale;
+  }
+  void present(int buf, const TileGrid &tiles, const unsigned char *changed, double swap_time)
+  {
+    XImage *image = bufs[buf].image;
+    // upload() has made room for at least one span
+    if (changed)
+      nspans = collect_spans(tiles, changed, NULL);
+    else
+    {
+      spans[0] = (Span){0, 0, tiles.width, tiles.height};
+      nspans = 1;
+    }
+    // Completion of the last request implies completion of the previous ones
+    for (int i = 0; i < nspans; i++)
+      XShmPutImage(dpy, window, gc, image, spans[i].x, spans[i].y, spans[i].x, spans[i].y,
+		   spans[i].w, spans[i].h, i == nspans - 1);
+    bufs[buf].busy = nspans > 0;
+    XFlush(dpy);
+  }
+};
+
+// Present events are generic events; keep their wire format as cookie data
+static Bool present_wire_to_cookie(Display *dpy, XGenericEventCookie *cookie, xEvent *wire)
+{
+  const xGenericEvent *ge = (const xGenericEvent *)wire;
+  size_t size = sizeof(xEvent) + ge->length * 4;
+  cookie->type = ge->type & 0x7f;
+  cookie->serial = _XSetLastRequestRead(dpy, (xGenericReply *)wire);
+  cookie->send_event = (ge->type & 0x80) != 0;
+  cookie->display = dpy;
+  cookie->extension = ge->extension;
+  cookie->evtype = ge->evtype;
+  cookie->data = malloc(size);
+  if (!cookie->data)
+    return False;
+  memcpy(cookie->data, wire, size);
+  return True;
+}
+
+// Check for the Present extension and prepare the connection for its events;
+// returns its major opcode, or 0 if it is not available
+static int query_present(Display *dpy)
+{
+  int opcode, event, error;
+  if (!XQueryExtension(dpy, PRESENT_NAME, &opcode, &event, &error))
+    return 0;
+  xPresentQueryVersionReq *req;
+  xPresentQueryVersionReply rep;
+  LockDisplay(dpy);
+  GetReq(PresentQueryVersion, req);
+  req->reqType = opcode;
+  req->presentReqType = X_PresentQueryVersion;
+  req->majorVersion = PRESENT_MAJOR;
+  req->minorVersion = PRESENT_MINOR;
+  Bool ok = _XReply(dpy, (xReply *)&rep, 0, xTrue);
+  UnlockDisplay(dpy);
+  SyncHandle();
+  if (!ok)
+    return 0;
+  XESetWireToEventCookie(dpy, opcode, present_wire_to_cookie);
+  return opcode;
+}
+
+// Put frames into pixmaps with MIT-SHM and have the X server show them with
+// the Present extension, which flips them to the screen when it can instead
+// of copying through the compositor.  Present reports when each frame reached
+// the screen, giving the real refresh period and latency, and when a pixmap
+// is idle again, which is when its buffer may be reused.
+struct PresentBackend: ShmBackend {
+  int opcode;
+  XID eid; // of the event context for the window
+  Pixmap *pixmaps;
+  unsigned serial; // of the last present
+  int interval;
+  // Swap times of presents by serial, and completions not taken yet
+  int nring;
+  double *swap_times;
+  struct Completion {
+    double swap_time, shown_time;
+  } *completions;
+  int ncompletions;
+  // Last completion, for the refresh period
+  uint64_t last_msc, last_ust;
+  double refresh;
+
+  PresentBackend(Display *dpy, Window window, int nbufs, CopyTeam *team, int opcode):
+    ShmBackend(dpy, window, nbufs, team), opcode(opcode), eid(XAllocID(dpy)), pixmaps(new Pixmap[nbufs]()),
+    serial(0), interval(1), nring(2 * nbufs + 2), swap_times(new double[nring]()),
+    completions(new Completion[nring]), ncompletions(0), last_msc(0), last_ust(0), refresh(0)
+  {
+    select_input(PresentCompleteNotifyMask | PresentIdleNotifyMask);
+  }
+  ~PresentBackend()
+  {
+    release();
+    select_input(0);
+    XSync(dpy, False);
+    delete[] completions;
+    delete[] swap_times;
+    delete[] pixmaps;
+  }
+  // An empty mask frees the event context
+  void select_input(unsigned mask)
+  {
+    xPresentSelectInputReq *req;
+    LockDisplay(dpy);
+    GetReq(PresentSelectInput, req);
+    req->reqType = opcode;
+    req->presentReqType = X_PresentSelectInput;
+    req->eid = eid;
+    req->window = window;
+    req->eventMask = mask;
+    UnlockDisplay(dpy);
+    SyncHandle();
+  }
+  // Images are done with once the server has processed the puts, while the
+  // pixmap on screen stays busy until another one replaces it; the server
+  // keeps pixmaps in use alive after they are freed
+  void release()
+  {
+    XSync(dpy, False);
+    for (int i = 0; i < nbufs; i++)
+    {
+      bufs[i].busy = false;
+      if (pixmaps[i])
+	XFreePixmap(dpy, pixmaps[i]);
+      pixmaps[i] = 0;
+    }
+    ShmBackend::release();
+  }
+  void resize(int width, int height)
+  {
+    ShmBackend::resize(width, height);
+    for (int i = 0; i < nbufs; i++)
+      pixmaps[i] = XCreatePixmap(dpy, window, width, height, attrs.depth);
+  }
+  // Present event of this window's context, if the event is one
+  template<typename T> const T *present_event(const XEvent &event, int evtype)
+  {
+    const XGenericEventCookie &cookie = event.xcookie;
+    if (event.type != GenericEvent || cookie.extension != opcode || cookie.evtype != evtype || !cookie.data)
+      return NULL;
+    const T *ev = (const T *)cookie.data;
+    return ev->eid == eid ? ev : NULL;
+  }
+  bool is_release(const XEvent &event)
+  {
+    return present_event<xPresentIdleNotify>(event, PresentIdleNotify) != NULL;
+  }
+  bool handle_event(const XEvent &event)
+  {
+    if (const xPresentIdleNotify *ev = present_event<xPresentIdleNotify>(event, PresentIdleNotify))
+    {
+      for (int i = 0; i < nbufs; i++)
+	if (pixmaps[i] == ev->pixmap)
+	  bufs[i].busy = false;
+      return true;
+    }
+    const xPresentCompleteNotify *ev = present_event<xPresentCompleteNotify>(event, PresentCompleteNotify);
+    if (!ev)
+      return false;
+    if (ev->kind != PresentCompleteKindPixmap || ev->mode == PresentCompleteModeSkip)
+      return true;
+    // UST is CLOCK_MONOTONIC in microseconds
+    if (last_ust && ev->msc > last_msc && ev->msc - last_msc <= 8)
+      refresh = (ev->ust - last_ust) * 1e-6 / (ev->msc - last_msc);
+    last_msc = ev->msc;
+    last_ust = ev->ust;
+    if (ncompletions < nring)
+      completions[ncompletions++] = (Completion){swap_times[ev->serial % nring], ev->ust * 1e-6};
+    return true;
+  }
+  int upload(int buf, const TileGrid &tiles, unsigned char *stale, const char *pixels)
+  {
+    int n = ShmBackend::upload(buf, tiles, stale, pixels);
+    // The pixmap lacks the same tiles as the image
+    for (int i = 0; i < nspans; i++)
+      XShmPutImage(dpy, pixmaps[buf], gc, bufs[buf].image, spans[i].x, spans[i].y, spans[i].x, spans[i].y,
+		   spans[i].w, spans[i].h, False);
+    return n;
+  }
+  void present(int buf, const TileGrid &tiles, const unsigned char *changed, double swap_time)
+  {
+    xPresentPixmapReq *req;
+    swap_times[++serial % nring] = swap_time;
+    LockDisplay(dpy);
+    GetReq(PresentPixmap, req);
+    req->reqType = opcode;
+    req->presentReqType = X_PresentPixmap;
+    req->window = window;
+    req->pixmap = pixmaps[buf];
+    req->serial = serial;
+    req->valid = req->update = None;
+    req->x_off = req->y_off = 0;
+    req->target_crtc = None;
+    req->wait_fence = req->idle_fence = None;
+    req->options = interval ? PresentOptionNone : PresentOptionAsync;
+    // With an interval, count from the last frame shown; otherwise the next
+    // vertical blank
+    req->target_msc = interval > 1 && last_msc ? last_msc + interval : 0;
+    req->divisor = req->remainder = 0;
+    UnlockDisplay(dpy);
+    SyncHandle();
+    bufs[buf].busy = true;
+    XFlush(dpy);
+  }
+  void set_swap_interval(int interval)
+  {
+    this->interval = interval;
+  }
+  double refresh_period()
+  {
+    return refresh;
+  }
+  bool has_feedback()
+  {
+    return true;
+  }
+  bool completion(double *swap_time, double *shown_time)
+  {
+    if (!ncompletions)
+      return false;
+    *swap_time = completions[0].swap_time;
+    *shown_time = completions[0].shown_time;
+    memmove(completions, completions + 1, --ncompletions * sizeof(Completion));
+    return true;
+  }
+};
+
+// Copy helpers of a display worker, created on first use; NULL on one CPU
+static CopyTeam *copy_team(CopyTeam **team)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (!*team && ncpus > 1)
+    *team = new CopyTeam(ncpus > 4 ? 3 : ncpus - 1);
+  return *team;
+}
+
+// Create the backend for a window; GL backends of a display connection share
+// the context, and MIT-SHM ones the copy team, created on first use
+static DisplayBackend *create_backend(Display *dpy, Window window, int nbufs, GLXContext *context, CopyTeam **team)
+{
+  if (primus.backend == 2)
+  {
+    int opcode = XShmQueryExtension(dpy) ? query_present(dpy) : 0;
+    if (opcode)
+      return new PresentBackend(dpy, window, nbufs, copy_team(team), opcode);
+    primus_warn("MIT-SHM or Present is not available, using OpenGL for display\n");
+  }
+  if (primus.backend == 1)
+  {
+    if (XShmQueryExtension(dpy))
+      return new ShmBackend(dpy, window, nbufs, copy_team(team));
+    primus_warn("MIT-SHM is not available, using OpenGL for display\n");
+  }
+  if (!*context)
+  {
+    *context = primus.dfns.glXCreateNewContext(dpy, primus.dconfigs[0], GLX_RGBA_TYPE, NULL, True);
+    die_if(!primus.dfns.glXIsDirect(dpy, *context),
+	   "failed to acquire direct rendering context for display thread\n");
+  }
+  return new GLBackend(dpy, window, nbufs, *context);
+}
+
+static const char *display_state_names[] = {"wait", "upload", "draw+swap", NULL};
+static const char *display_counter_names[] = {"tiles uploaded", "tiles skipped", NULL};
+
+// State of the display worker for one drawable
+struct DisplayState {
+  DrawableInfo &di;
+  Window window;
+  DisplayBackend *backend;
+  TileGrid grid; // of the last frame
+  int out_width, out_height; // what the last frame was shown at
+  const int nbufs;
+  int cbuf;
+  // Tiles that each buffer lacks compared to the latest frame, and tiles that
+  // the latest frame changed on screen
+  unsigned char **stale, *fresh;
+  bool exposed;
+  // Whether buffer cbuf - 1 holds a frame shown on the window
+  bool shown;
+  // Visibility of the window, and whether it became visible since the last
+  // frame was shown
+  bool mapped, obscured, reappeared;
+  int swap_request; // last applied to the backend
+  Profiler profiler;
+  DisplayState *next;
+
+  DisplayState(DrawableInfo &di, Display *dpy, GLXContext *context, CopyTeam **team):
+    di(di), window(di.window), out_width(0), out_height(0), nbufs(di.queue.capacity + 1), cbuf(0),
+    stale(new unsigned char*[nbufs]()), fresh(NULL), exposed(false), shown(false), mapped(true),
+    obscured(false), reappeared(false), swap_request(0),
+    profiler("display", di.window, display_state_names, display_counter_names), next(NULL)
+  {
+    int width, height;
+    assert(di.kind == di.XWindow || di.kind == di.Window);
+    grid.init(0, 0, 0);
+    XSelectInput(dpy, window, StructureNotifyMask | ExposureMask | VisibilityChangeMask);
+    if (di.kind == di.XWindow)
+      block_compositing(dpy, window);
+    XWindowAttributes attrs;
+    XGetWindowAttributes(dpy, window, &attrs);
+    width = attrs.width;
+    height = attrs.height;
+    if (di.width != width || di.height != height) {
+      di.reinit = di.RESIZE; di.width = width; di.height = height;
+    }
+    // A mapped window may be unviewable while an ancestor is unmapped, which
+    // brings it no MapNotify later; VisibilityNotify tells when it is seen
+    mapped = attrs.map_state != IsUnmapped;
+    __atomic_store_n(&di.hidden, !mapped, __ATOMIC_RELAXED);
+    backend = create_backend(dpy, window, nbufs, context, team);
+    __atomic_store_n(&di.refresh_ns, (long)(backend->refresh_period() * 1e9), __ATOMIC_RELAXED);
+  }
+  ~DisplayState()
+  {
+    __atomic_store_n(&di.hidden, false, __ATOMIC_RELAXED);
+    delete backend;
+    for (int i = 0; i < nbufs; i++)
+      delete[] stale[i];
+    delete[] stale;
+    delete[] fresh;
+  }
+  // Returns false if the event is not for this window
+  bool handle_event(const XEvent &event)
+  {
+    if (backend->handle_event(event))
+    {
+      take_completions();
+      return true;
+    }
+    if (event.type == GenericEvent)
+      return false;
+    if (event.type == Expose)
+      exposed = true;
+    if (event.type == MapNotify || event.type == UnmapNotify || event.type == VisibilityNotify)
+    {
+      if (event.type == VisibilityNotify)
+	obscured = event.xvisibility.state == VisibilityFullyObscured;
+      else
+	mapped = event.type == MapNotify;
+      bool hidden = !mapped || obscured;
+      if (!hidden && di.hidden)
+      {
+	primus_perf("display 0x%lx: visible again\n", window);
+	reappeared = true;
+      }
+      else if (hidden && !di.hidden)
+	primus_perf("display 0x%lx: hidden\n", window);
+      __atomic_store_n(&di.hidden, hidden, __ATOMIC_RELAXED);
+    }
+    if (event.type != ConfigureNotify)
+      return true;
+    di.reinit = di.RESIZE; di.width = event.xconfigure.width; di.height = event.xconfigure.height;
+    return true;
+  }
+  // Account for frames the backend learned to have reached the screen, and
+  // pass the refresh period measured on the way on to pacing
+  void take_completions()
+  {
+    double swap_time, shown_time;
+    while (backend->completion(&swap_time, &shown_time))
+      profiler.record_latency(swap_time, shown_time);
+    if (double refresh = backend->refresh_period())
+      __atomic_store_n(&di.refresh_ns, (long)(refresh * 1e9), __ATOMIC_RELAXED);
+  }
+  void show(DrawableInfo::FrameQueue::Slot &frame)
+  {
+    DrawableInfo::FrameQueue &queue = di.queue;
+    if (frame.reinit)
+    {
+      TraceScope scope("reinit", window);
+      // Reallocate for the largest frames that fit
+      grid = frame.grid;
+      for (int i = 0; i < nbufs; i++)
+      {
+	delete[] stale[i];
+	stale[i] = new unsigned char[grid.ntiles()];
+	memset(stale[i], 1, grid.ntiles());
+      }
+      delete[] fresh;
+      fresh = new unsigned char[grid.ntiles()];
+      backend->resize(grid.width, grid.height);
+      shown = false;
+      if (primus.sync == 4)
+	di.mailbox.reset();
+      queue.pop();
+      return;
+    }
+    if (frame.grid != grid)
+    {
+      // Resized within the allocation: tiles no longer line up
+      grid = frame.grid;
+      for (int i = 0; i < nbufs; i++)
+	memset(stale[i], 1, grid.ntiles());
+      exposed = true;
+    }
+    if (frame.out_width != out_width || frame.out_height != out_height)
+    {
+      out_width = frame.out_width;
+      out_height = frame.out_height;
+      backend->set_output_size(out_width, out_height);
+      exposed = true;
+    }
+    const int ntiles = grid.ntiles();
+    bool changed = false;
+    memcpy(fresh, frame.changed, ntiles);
+    for (int i = 0; i < ntiles; i++)
+      if (fresh[i])
+      {
+	for (int b = 0; b < nbufs; b++)
+	  stale[b][i] = 1;
+	changed = true;
+      }
+    if (!changed && !exposed)
+    {
+      // Same frame as on screen already: skip upload and swap
+      profiler.count(1, ntiles);
+      if (frame.sync != 4)
+	queue.pop();
+      profiler.tick();
+      profiler.tick();
+      return;
+    }
+    double swap_time = frame.swap_time;
+    trace('B', "upload", window);
+    int nuploaded = backend->upload(cbuf, grid, stale[cbuf], (const char *)frame.pixeldata);
+    trace('E', "upload", window);
+    profiler.count(0, nuploaded);
+    profiler.count(1, ntiles - nuploaded);
+    const int sync = frame.sync;
+    if (!sync)
+      queue.pop(); // Unlock as soon as possible
     profiler.tick();
-    for (int pending = XPending(ddpy); pending > 0; pending--)
+    int request = __atomic_load_n(&di.swap_request, __ATOMIC_RELAXED);
+    if (request != swap_request)
     {
-      XEvent event;
-      XNextEvent(ddpy, &event);
-      if (event.type != ConfigureNotify)
-	continue;
-      di.reinit = di.RESIZE; di.width = event.xconfigure.width; di.height = event.xconfigure.height;
+      swap_request = request;
+      backend->set_swap_interval(request - 1);
     }
-    primus.dfns.glDrawArrays(GL_QUADS, 0, 4);
-    primus.dfns.glXSwapBuffers(ddpy, di.window);
-    primus.dfns.glBindTexture(GL_TEXTURE_RECTANGLE, textures[ctex ^= 1]);
-    if (primus.sync)
-      sem_post(&di.d.relsem); // Unlock only after drawing
+    trace('B', "present", window);
+    backend->present(cbuf, grid, exposed ? NULL : fresh, swap_time);
+    trace('E', "present", window);
+    if (backend->has_feedback())
+      take_completions();
+    else
+      profiler.record_latency(swap_time, get_time());
+    exposed = false;
+    shown = true;
+    reappeared = false;
+    cbuf = (cbuf + 1) % nbufs;
+    if (sync == 1 || sync == 2)
+      queue.pop(); // Unlock only after drawing
     profiler.tick();
   }
-  return NULL;
+  // Put the last frame shown back on the window once it is visible again,
+  // without waiting for the application's next frame
+  void redraw()
+  {
+    reappeared = false;
+    if (!shown)
+      return;
+    TraceScope scope("redraw", window);
+    backend->present((cbuf + nbufs - 1) % nbufs, grid, NULL, get_time());
+    if (backend->has_feedback())
+      take_completions();
+    exposed = false;
+  }
+};
+
+// Put the last frame back on windows that became visible again, activating
+// their backends in turn
+static void redraw_reappeared(DisplayState *states, DisplayState **active)
+{
+  for (DisplayState *s = states; s; s = s->next)
+    if (s->reappeared)
+    {
+      if (*active != s)
+      {
+	s->backend->activate();
+	*active = s;
+      }
+      s->redraw();
+    }
 }
 
-static void* readback_work(void *vd)
+// Dispatch the X events that arrived on a display worker's connection to the
+// windows they are for
+static void handle_events(Display *dpy, DisplayState *states)
 {
-  GLXDrawable drawable = (GLXDrawable)vd;
-  DrawableInfo &di = primus.drawables[drawable];
-  int width, height;
-  GLuint pbos[2] = {0};
-  int cbuf = 0;
-  static const char *state_names[] = {"app", "map", "wait", NULL};
-  Profiler profiler("readback", state_names);
-  struct timespec tp;
-  if (!primus.sync)
-    sem_post(&di.d.relsem); // No PBO is mapped initially
-  GLXContext context = primus.afns.glXCreateNewContext(primus.adpy, di.fbconfig, GLX_RGBA_TYPE, di.actx, True);
-  die_if(!primus.afns.glXIsDirect(primus.adpy, context),
-	 "failed to acquire direct rendering context for readback thread\n");
-  primus.afns.glXMakeCurrent(primus.adpy, di.pbuffer, context);
-  primus.afns.glGenBuffers(2, &pbos[0]);
-  primus.afns.glReadBuffer(GL_BACK);
+  for (int pending = XPending(dpy); pending > 0; pending--)
+  {
+    XEvent event;
+    XNextEvent(dpy, &event);
+    // Generic events name their window in their data, so each backend
+    // checks them in turn
+    if (event.type == GenericEvent)
+    {
+      if (XGetEventData(dpy, &event.xcookie))
+	for (DisplayState *s = states; s && !s->handle_event(event); s = s->next);
+      XFreeEventData(dpy, &event.xcookie);
+      continue;
+    }
+    for (DisplayState *s = states; s; s = s->next)
+      if (s->window == event.xany.window)
+      {
+	s->handle_event(event);
+	break;
+      }
+  }
+}
+
+static void* display_work(void *vw)
+{
+  WorkerPool::Worker &worker = *(WorkerPool::Worker *)vw;
+  Display *ddpy = XOpenDisplay(NULL);
+  GLXContext context = NULL;
+  CopyTeam *team = NULL;
+  // Drawables served by this worker, and the one whose backend is active
+  DisplayState *states = NULL, *active = NULL;
+  trace_thread_name = "display worker";
   for (;;)
   {
-    sem_wait(&di.r.acqsem);
+    // Applications send no frames for hidden windows, so while there are any,
+    // look for events every 100 ms to learn when they become visible again
+    bool any_hidden = false;
+    for (DisplayState *s = states; s; s = s->next)
+      any_hidden |= __atomic_load_n(&s->di.hidden, __ATOMIC_RELAXED);
+    JobQueue::Job job;
+    trace('B', "wait for frame");
+    if (any_hidden)
+    {
+      struct timespec tp;
+      clock_gettime(CLOCK_REALTIME, &tp);
+      tp.tv_nsec += 100000000;
+      tp.tv_sec += tp.tv_nsec / 1000000000;
+      tp.tv_nsec %= 1000000000;
+      if (!worker.jobs.pop(&job, &tp))
+      {
+	trace('E', "wait for frame");
+	handle_events(ddpy, states);
+	redraw_reappeared(states, &active);
+	continue;
+      }
+    }
+    else
+      job = worker.jobs.pop();
+    trace('E', "wait for frame");
+    if (!job.di)
+      break;
+    DrawableInfo &di = *job.di;
+    // In mailbox mode only reinit requests are queued; jobs for frames find
+    // none if a newer one was taken already.  Jobs run in the order they were
+    // pushed, so none are left once the shutdown request is done.
+    DrawableInfo::FrameQueue::Slot *pframe = job.mailbox ? di.mailbox.take() : &di.queue.front();
+    if (!pframe)
+      continue;
+    DrawableInfo::FrameQueue::Slot &frame = *pframe;
+    // The window may be gone already: do not bind it again
+    if (frame.reinit == di.SHUTDOWN)
+    {
+      if (di.dstate)
+      {
+	DisplayState **link = &states;
+	while (*link != di.dstate)
+	  link = &(*link)->next;
+	*link = di.dstate->next;
+	if (active == di.dstate)
+	  active = NULL;
+	delete di.dstate;
+	di.dstate = NULL;
+      }
+      di.queue.pop();
+      continue;
+    }
+    if (!di.dstate)
+    {
+      di.dstate = active = new DisplayState(di, ddpy, &context, &team);
+      di.dstate->next = states;
+      states = di.dstate;
+    }
+    DisplayState &st = *di.dstate;
+    st.profiler.tick(true);
+    if (active != &st)
+    {
+      st.backend->activate();
+      active = &st;
+    }
+    handle_events(ddpy, states);
+    st.show(frame);
+    // Windows without frames of their own, if other windows keep this worker
+    // from timing out
+    redraw_reappeared(states, &active);
+  }
+  if (context)
+  {
+    primus.dfns.glXMakeCurrent(ddpy, 0, NULL);
+    primus.dfns.glXDestroyContext(ddpy, context);
+  }
+  delete team;
+  XCloseDisplay(ddpy);
+  return NULL;
+}
+
+// Ring of PBOs that frames are read back into.  With ARB_buffer_storage they
+// are mapped persistently once per resize, and completion of readback is
+// tracked with fences; otherwise they are mapped for each frame and stay
+// mapped until reused.  With ARB_timer_query, GPU time of readback is measured.
+struct PackBuffers {
+  int n;
+  bool persistent, timed;
+  struct Buffer {
+    GLuint pbo;
+    GLvoid *data; // non-NULL while mapped
+    GLsync fence;
+    GLuint queries[2];
+    bool timing; // queries were issued for the last readback
+  } *bufs;
+
+  // Needs current context
+  PackBuffers(int n): n(n), bufs(new Buffer[n]())
+  {
+    const char *exts = (const char *)primus.afns.glGetString(GL_EXTENSIONS);
+    persistent = has_extension(exts, "GL_ARB_buffer_storage");
+    timed = has_extension(exts, "GL_ARB_timer_query");
+    primus.afns.glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int i = 0; i < n; i++)
+    {
+      primus.afns.glGenBuffers(1, &bufs[i].pbo);
+      if (timed)
+	primus.afns.glGenQueries(2, bufs[i].queries);
+    }
+  }
+  ~PackBuffers()
+  {
+    for (int i = 0; i < n; i++)
+    {
+      release(i);
+      primus.afns.glDeleteBuffers(1, &bufs[i].pbo);
+      if (timed)
+	primus.afns.glDeleteQueries(2, bufs[i].queries);
+    }
+    delete[] bufs;
+  }
+  void release(int i)
+  {
+    Buffer &b = bufs[i];
+    if (b.fence)
+      primus.afns.glDeleteSync(b.fence);
+    b.fence = 0;
+    if (b.data)
+    {
+      primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, b.pbo);
+      primus.afns.glUnmapBuffer(GL_PIXEL_PACK_BUFFER_EXT);
+    }
+    b.data = NULL;
+    b.timing = false;
+  }
+  void resize(int size)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      Buffer &b = bufs[i];
+      release(i);
+      if (persistent)
+      {
+	// Buffer storage is immutable, so get a fresh buffer
+	const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	primus.afns.glDeleteBuffers(1, &b.pbo);
+	primus.afns.glGenBuffers(1, &b.pbo);
+	primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, b.pbo);
+	primus.afns.glBufferStorage(GL_PIXEL_PACK_BUFFER_EXT, size, NULL, flags);
+	b.data = primus.afns.glMapBufferRange(GL_PIXEL_PACK_BUFFER_EXT, 0, size, flags);
+	die_if(!b.data, "failed to map readback buffer persistently\n");
+      }
+      else
+      {
+	primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, b.pbo);
+	primus.afns.glBufferData(GL_PIXEL_PACK_BUFFER_EXT, size, NULL, GL_STREAM_READ);
+      }
+    }
+  }
+  // With another context of the sharegroup made current, which shares the
+  // buffers but neither pixel store state nor the timer queries; GPU time of
+  // readbacks is no longer measured
+  void switch_context()
+  {
+    primus.afns.glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int i = 0; i < n; i++)
+      bufs[i].timing = false;
+    timed = false;
+  }
+  // Issue asynchronous readback of the framebuffer into buffer i, holding
+  // frames of the given size; with rect (x, y, width, height), only that part
+  // is read and the rest of the buffer is left as it was
+  void read(int i, int width, int height, const int *rect = NULL)
+  {
+    Buffer &b = bufs[i];
+    if (!persistent)
+      release(i);
+    primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, b.pbo);
+    if (timed)
+      primus.afns.glQueryCounter(b.queries[0], GL_TIMESTAMP);
+    if (rect)
+    {
+      primus.afns.glPixelStorei(GL_PACK_ROW_LENGTH, width);
+      primus.afns.glReadPixels(rect[0], rect[1], rect[2], rect[3], primus.format->format, primus.format->type,
+			       (GLvoid *)(size_t)((rect[1] * width + rect[0]) * primus.format->bytes));
+      primus.afns.glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    }
+    else
+      primus.afns.glReadPixels(0, 0, width, height, primus.format->format, primus.format->type, NULL);
+    if (timed)
+      primus.afns.glQueryCounter(b.queries[1], GL_TIMESTAMP);
+    b.timing = timed;
+    if (persistent)
+    {
+      if (b.fence)
+	primus.afns.glDeleteSync(b.fence);
+      b.fence = primus.afns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+  }
+  // Wait until readback into buffer i completes and return its contents, or
+  // NULL if that takes longer than a second; gpu_ms receives GPU time spent on
+  // the readback, or a negative value if not known
+  GLvoid *map(int i, double *gpu_ms)
+  {
+    Buffer &b = bufs[i];
+    *gpu_ms = -1;
+    if (persistent && b.fence)
+    {
+      GLenum r = primus.afns.glClientWaitSync(b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+      for (int waited = 0; r == GL_TIMEOUT_EXPIRED && waited < 1000; waited++)
+	r = primus.afns.glClientWaitSync(b.fence, 0, 1000000);
+      if (r != GL_ALREADY_SIGNALED && r != GL_CONDITION_SATISFIED)
+	return NULL;
+      primus.afns.glDeleteSync(b.fence);
+      b.fence = 0;
+    }
+    else if (!persistent)
+    {
+      primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, b.pbo);
+      b.data = primus.afns.glMapBuffer(GL_PIXEL_PACK_BUFFER_EXT, GL_READ_ONLY);
+    }
+    GLint available = 0;
+    if (b.timing)
+      primus.afns.glGetQueryObjectiv(b.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available)
+    {
+      GLuint64 begin, end;
+      primus.afns.glGetQueryObjectui64v(b.queries[0], GL_QUERY_RESULT, &begin);
+      primus.afns.glGetQueryObjectui64v(b.queries[1], GL_QUERY_RESULT, &end);
+      *gpu_ms = (end - begin) * 1e-6;
+    }
+    return b.data;
+  }
+  // Buffer i will not be used by the display worker until the next readback
+  void unmap(int i)
+  {
+    if (!persistent)
+      release(i);
+  }
+};
+
+// Contexts of a readback worker, one per sharegroup and FBConfig; they share
+// objects with the application's context, so GL sync objects can be waited on
+struct ReadbackContexts {
+  struct Entry {
+    int sharegroup;
+    GLXFBConfig fbconfig;
+    GLXContext context;
+  } *entries;
+  int n;
+
+  ReadbackContexts(): entries(NULL), n(0) {}
+  ~ReadbackContexts()
+  {
+    primus.afns.glXMakeCurrent(primus.adpy, 0, NULL);
+    for (int i = 0; i < n; i++)
+      primus.afns.glXDestroyContext(primus.adpy, entries[i].context);
+    delete[] entries;
+  }
+  GLXContext get(const DrawableInfo &di)
+  {
+    // Share with a context of ours if there is one, as the application may
+    // have destroyed its context since starting the pipeline
+    GLXContext share = di.actx;
+    for (int i = 0; i < n; i++)
+      if (entries[i].sharegroup == di.sharegroup && entries[i].fbconfig == di.fbconfig)
+	return entries[i].context;
+      else if (entries[i].sharegroup == di.sharegroup)
+	share = entries[i].context;
+    GLXContext context = primus.afns.glXCreateNewContext(primus.adpy, di.fbconfig, GLX_RGBA_TYPE, share, True);
+    die_if(!primus.afns.glXIsDirect(primus.adpy, context),
+	   "failed to acquire direct rendering context for readback thread\n");
+    Entry *grown = new Entry[n + 1];
+    memcpy(grown, entries, n * sizeof(Entry));
+    delete[] entries;
+    entries = grown;
+    entries[n++] = (Entry){di.sharegroup, di.fbconfig, context};
+    return context;
+  }
+  // Destroy the contexts of a sharegroup; leaves no context current
+  void reap(int sharegroup)
+  {
+    primus.afns.glXMakeCurrent(primus.adpy, 0, NULL);
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+      if (entries[i].sharegroup == sharegroup)
+	primus.afns.glXDestroyContext(primus.adpy, entries[i].context);
+      else
+	entries[kept++] = entries[i];
+    n = kept;
+  }
+};
+
+static const char *readback_state_names[] = {"app", "map", "diff", "wait", NULL};
+static const char *readback_counter_names[] = {"frames queued", "ms GPU readback", "sync mode", "ms past deadline", NULL};
+static const char *readback_event_names[] = {"drops", "stalls", "superseded", NULL};
+
+// Queue a frame or reinit request for the drawable's display worker
+static void push_frame(DrawableInfo &di)
+{
+  di.queue.push();
+  primus.workers.display[di.worker].jobs.push(&di);
+}
+
+// Choice of synchronization mode for a drawable with PRIMUS_SYNC=3.  More
+// synchronized modes have lower latency, so the most synchronized one is used
+// that keeps the frame rate within PRIMUS_SYNC_TOLERANCE percent of the best
+// rate measured in any mode.  Rates are measured every second; moving to a
+// more synchronized mode takes several good periods in a row, and a mode that
+// fell short is retried only after a while.
+struct AdaptiveSync {
+  enum {PATIENCE = 3, RETRY = 10};
+  int mode;
+  double fps[3], measured[3]; // frame rate in each mode, and when measured
+  double period_start;
+  int frames, good;
+
+  AdaptiveSync(): mode(0), period_start(0), frames(0), good(0)
+  {
+    memset(fps, 0, sizeof(fps));
+    memset(measured, 0, sizeof(measured));
+  }
+  // Count a displayed frame
+  void frame_done()
+  {
+    frames++;
+  }
+  // Returns true if the mode changed
+  bool update(double now)
+  {
+    if (!period_start)
+      period_start = now;
+    double elapsed = now - period_start;
+    if (elapsed < 1)
+      return false;
+    if (elapsed > 2)
+    {
+      // The application paused; its frame rate says nothing about the mode
+      period_start = now;
+      frames = 0;
+      return false;
+    }
+    double rate = frames / elapsed;
+    fps[mode] = now - measured[mode] < 2 ? (fps[mode] + rate) / 2 : rate;
+    measured[mode] = now;
+    period_start = now;
+    frames = 0;
+    double best = 0;
+    for (int i = 0; i < 3; i++)
+      if (fps[i] > best)
+	best = fps[i];
+    double target = best * (1 - primus.sync_tolerance * 0.01);
+    int next = mode;
+    if (fps[mode] < target && mode > 0)
+      next = mode - 1;
+    else if (mode < 2 && ++good >= PATIENCE && (now - measured[mode + 1] >= RETRY || fps[mode + 1] >= target))
+      next = mode + 1;
+    if (next == mode)
+      return false;
+    good = 0;
+    mode = next;
+    return true;
+  }
+};
+
+// State of the readback worker for one drawable
+struct ReadbackState {
+  DrawableInfo &di;
+  GLXContext context;
+  PackBuffers *pbos;
+  TileDiff tiles;
+  int cbuf;
+  double *swap_times; // of frames in PBOs
+  Profiler profiler;
+  AdaptiveSync adaptive;
+  int prev_sync; // mode of the previous frame
+  int last; // buffer with the last frame queued in full, or -1
+  // What the context is made for and current with
+  GLXFBConfig fbconfig;
+  GLXPbuffer pbuffer;
+  unsigned char *unseen; // tiles changed since the frame the display last took
+
+  // Leaves the context current
+  ReadbackState(DrawableInfo &di, GLXContext context):
+    di(di), context(context), cbuf(0), swap_times(new double[di.queue.capacity + 1]()),
+    profiler("readback", di.window, readback_state_names, readback_counter_names, readback_event_names),
+    prev_sync(primus.sync), last(-1), fbconfig(di.fbconfig), pbuffer(di.pbuffer), unseen(NULL)
+  {
+    primus.afns.glXMakeCurrent(primus.adpy, di.pbuffer, context);
+    pbos = new PackBuffers(di.queue.capacity + 1);
+  }
+  // Needs the context current
+  ~ReadbackState()
+  {
+    delete[] unseen;
+    delete[] swap_times;
+    delete pbos;
+  }
+  // Hand the frame in the mailbox back slot to the display worker; it lists
+  // all tiles changed since the frame the display worker took last
+  void publish(GLvoid *pixeldata, double swap_time, int out_width, int out_height)
+  {
+    if (!pixeldata)
+    {
+      primus_warn("dropping a frame after readback timeout\n");
+      profiler.event(0);
+      return;
+    }
+    DrawableInfo::FrameQueue::Slot &frame = di.mailbox.slots[di.mailbox.back];
+    frame.reinit = di.NONE;
+    frame.grid = tiles;
+    frame.out_width = out_width;
+    frame.out_height = out_height;
+    frame.pixeldata = pixeldata;
+    frame.swap_time = swap_time;
+    frame.sync = 4;
+    tiles.take(frame.changed);
+    const int ntiles = tiles.ntiles();
+    if (di.mailbox.pending())
+      for (int i = 0; i < ntiles; i++)
+	frame.changed[i] |= unseen[i];
+    memcpy(unseen, frame.changed, ntiles);
+    if (di.mailbox.publish())
+      profiler.event(2);
+    primus.workers.display[di.worker].jobs.push(&di, -1, true);
+  }
+  // Returns false once the pipeline is shut down
+  bool read_frame()
+  {
+    DrawableInfo::FrameQueue &queue = di.queue;
+    const int npbos = queue.capacity + 1;
+    struct timespec tp;
+    // Main thread may change these once unblocked
+    int width = di.r.width, height = di.r.height;
+    int out_width = di.r.out_width, out_height = di.r.out_height;
+    int sub[4];
+    memcpy(sub, di.r.sub, sizeof(sub));
+    swap_times[cbuf] = di.swap_time;
+    if (di.lateness >= 0)
+      profiler.count(3, di.lateness * 1e3);
     profiler.tick(true);
     if (di.r.reinit)
     {
+      TraceScope scope(di.r.reinit == di.SHUTDOWN ? "shutdown" : "reinit", di.window);
       clock_gettime(CLOCK_REALTIME, &tp);
       tp.tv_sec  += 1;
-      // Wait for D worker, if active
-      if (!primus.sync && sem_timedwait(&di.d.relsem, &tp))
+      // Wait for D worker to finish with queued frames
+      if (!queue.drain(&tp))
       {
-	pthread_cancel(di.d.worker);
-	sem_post(&di.d.relsem); // Pretend that D worker completed reinit
 	primus_warn("timeout waiting for display worker\n");
-	die_if(di.r.reinit != di.SHUTDOWN, "killed worker on resize\n");
+	die_if(di.r.reinit != di.SHUTDOWN, "display worker stuck on resize\n");
+	queue.drain(NULL);
       }
-      di.d.reinit = di.r.reinit;
-      sem_post(&di.d.acqsem); // Signal D worker to reinit
-      sem_wait(&di.d.relsem); // Wait until reinit was completed
-      if (!primus.sync)
-	sem_post(&di.d.relsem); // Unlock as no PBO is currently mapped
+      TileGrid alloc;
+      alloc.init(primus.tile_size, di.alloc_width, di.alloc_height);
+      queue.acquire(NULL);
+      queue.back().reinit = di.r.reinit;
+      queue.back().grid = alloc;
+      push_frame(di); // Signal D worker to reinit
+      queue.drain(NULL); // Wait until reinit was completed
       if (di.r.reinit == di.SHUTDOWN)
+	return false;
+      queue.resize_tiles(alloc.ntiles());
+      if (primus.sync == 4)
       {
-	primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, pbos[cbuf ^ 1]);
-	primus.afns.glUnmapBuffer(GL_PIXEL_PACK_BUFFER_EXT);
-	primus.afns.glDeleteBuffers(2, &pbos[0]);
-	primus.afns.glXMakeCurrent(primus.adpy, 0, NULL);
-	primus.afns.glXDestroyContext(primus.adpy, context);
-	sem_post(&di.r.relsem);
-	return NULL;
+	di.mailbox.resize_tiles(alloc.ntiles());
+	delete[] unseen;
+	unseen = new unsigned char[alloc.ntiles()]();
       }
       di.r.reinit = di.NONE;
-      width = di.width; height = di.height;
       primus.afns.glXMakeCurrent(primus.adpy, di.pbuffer, context);
-      primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, pbos[cbuf ^ 1]);
-      primus.afns.glBufferData(GL_PIXEL_PACK_BUFFER_EXT, width*height*4, NULL, GL_STREAM_READ);
-      primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, pbos[cbuf]);
-      primus.afns.glBufferData(GL_PIXEL_PACK_BUFFER_EXT, width*height*4, NULL, GL_STREAM_READ);
-    }
-    primus.afns.glWaitSync(di.sync, 0, GL_TIMEOUT_IGNORED);
-    primus.afns.glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
-    if (!primus.sync)
+      pbuffer = di.pbuffer;
+      pbos->resize(di.alloc_width*di.alloc_height*primus.format->bytes);
+      tiles.reset(0, 0, 0);
+      last = -1;
+    }
+    if (width != tiles.width || height != tiles.height)
+    {
+      tiles.reset(primus.tile_size, width, height);
+      last = -1;
+    }
+    int sync = primus.sync;
+    if (sync == 3)
+    {
+      if (adaptive.update(get_time()))
+      {
+	primus_perf("readback 0x%lx: switching to PRIMUS_SYNC=%d\n", di.window, adaptive.mode);
+	trace('i', "sync mode change", di.window);
+      }
+      sync = adaptive.mode;
+    }
+    profiler.count(2, sync);
+    // A partial update is read into the buffer with the last frame, once the
+    // display worker is done with it; other modes read whole frames
+    bool partial = sub[2] > 0 && last >= 0 && (sync == 0 || sync == 2);
+    if (partial)
+    {
+      clock_gettime(CLOCK_REALTIME, &tp);
+      tp.tv_sec  += 1;
+      trace('B', "wait for display", di.window);
+      partial = queue.drain(&tp);
+      trace('E', "wait for display", di.window);
+    }
+    if (partial)
+    {
+      cbuf = last;
+      swap_times[cbuf] = di.swap_time;
+    }
+    if (sync == 4)
+      cbuf = di.mailbox.back;
+    double swap_time = di.swap_time;
+    if (di.sync)
+      primus.afns.glWaitSync(di.sync, 0, GL_TIMEOUT_IGNORED);
+    trace('B', "glReadPixels", di.window);
+    pbos->read(cbuf, width, height, partial ? sub : NULL);
+    trace('E', "glReadPixels", di.window);
+    if (!sync || sync == 4)
       sem_post(&di.r.relsem); // Unblock main thread as soon as possible
-    if (primus.sync == 1) // Get the previous framebuffer
-      primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, pbos[cbuf ^ 1]);
-    GLvoid *pixeldata = primus.afns.glMapBuffer(GL_PIXEL_PACK_BUFFER_EXT, GL_READ_ONLY);
+    // With PRIMUS_SYNC=1, display the previous framebuffer, unless the mode has
+    // just changed and it may still be held by the display worker
+    int mbuf = sync == 1 && prev_sync == 1 ? (cbuf + npbos - 1) % npbos : cbuf;
+    prev_sync = sync;
+    double gpu_ms;
+    trace('B', "map", di.window);
+    GLvoid *pixeldata = pbos->map(mbuf, &gpu_ms);
+    trace('E', "map", di.window);
+    if (gpu_ms >= 0)
+      profiler.count(1, gpu_ms);
     profiler.tick();
+    if (pixeldata)
+    {
+      TraceScope scope("diff", di.window);
+      tiles.update((const char *)pixeldata, partial ? sub : NULL);
+    }
+    profiler.tick();
+    last = -1;
+    if (sync == 4)
+    {
+      publish(pixeldata, swap_time, out_width, out_height);
+      profiler.tick();
+      return true;
+    }
     clock_gettime(CLOCK_REALTIME, &tp);
     tp.tv_sec  += 1;
-    if (!primus.sync && sem_timedwait(&di.d.relsem, &tp))
-      primus_warn("dropping a frame to avoid deadlock\n");
+    if (pixeldata && queue.occupancy() == queue.capacity)
+      profiler.event(1);
+    trace('B', "wait for queue", di.window);
+    bool queued = pixeldata && queue.acquire(sync ? NULL : &tp);
+    trace('E', "wait for queue", di.window);
+    if (!queued)
+    {
+      primus_warn("dropping a frame %s\n", pixeldata ? "to avoid deadlock" : "after readback timeout");
+      profiler.event(0);
+      pbos->unmap(mbuf);
+      if (sync)
+	sem_post(&di.r.relsem);
+      if (partial)
+	cbuf = (cbuf + 1) % npbos;
+    }
     else
     {
-      di.pixeldata = pixeldata;
-      sem_post(&di.d.acqsem);
-      if (primus.sync)
+      DrawableInfo::FrameQueue::Slot &frame = queue.back();
+      frame.reinit = di.NONE;
+      frame.grid = tiles;
+      frame.out_width = out_width;
+      frame.out_height = out_height;
+      frame.pixeldata = pixeldata;
+      frame.swap_time = swap_times[mbuf];
+      frame.sync = sync;
+      tiles.take(frame.changed);
+      push_frame(di);
+      adaptive.frame_done();
+      profiler.count(0, queue.occupancy());
+      if (sync)
       {
-	sem_wait(&di.d.relsem);
+	trace('B', "wait for display", di.window);
+	queue.drain(NULL);
+	trace('E', "wait for display", di.window);
 	sem_post(&di.r.relsem); // Unblock main thread only after D::work has completed
+	pbos->unmap(mbuf);
       }
-      cbuf ^= 1;
-      primus.afns.glBindBuffer(GL_PIXEL_PACK_BUFFER_EXT, pbos[cbuf]);
+      if (sync != 1)
+	last = mbuf;
+      cbuf = (cbuf + 1) % npbos;
     }
-    primus.afns.glUnmapBuffer(GL_PIXEL_PACK_BUFFER_EXT);
     profiler.tick();
+    return true;
+  }
+};
+
+static void* readback_work(void *vw)
+{
+  WorkerPool::Worker &worker = *(WorkerPool::Worker *)vw;
+  ReadbackContexts contexts;
+  ReadbackState *active = NULL;
+  trace_thread_name = "readback worker";
+  for (;;)
+  {
+    trace('B', "wait for swap");
+    JobQueue::Job job = worker.jobs.pop();
+    trace('E', "wait for swap");
+    if (!job.di && job.reap >= 0)
+    {
+      contexts.reap(job.reap);
+      active = NULL;
+      continue;
+    }
+    if (!job.di)
+      break;
+    DrawableInfo &di = *job.di;
+    if (!di.rstate)
+      di.rstate = active = new ReadbackState(di, contexts.get(di));
+    ReadbackState &st = *di.rstate;
+    if (st.fbconfig != di.fbconfig)
+    {
+      // The application switched to a context of another FBConfig
+      st.context = contexts.get(di);
+      st.fbconfig = di.fbconfig;
+      primus.afns.glXMakeCurrent(primus.adpy, di.pbuffer, st.context);
+      st.pbos->switch_context();
+      st.pbuffer = di.pbuffer;
+      active = &st;
+    }
+    else if (active != &st || st.pbuffer != di.pbuffer)
+    {
+      primus.afns.glXMakeCurrent(primus.adpy, di.pbuffer, st.context);
+      st.pbuffer = di.pbuffer;
+      active = &st;
+    }
+    primus.afns.glReadBuffer(GL_BACK);
+    if (!st.read_frame())
+    {
+      delete di.rstate;
+      di.rstate = active = NULL;
+      sem_post(&di.r.relsem);
+    }
   }
   return NULL;
 }
 
-// Find appropriate FBConfigs on adpy for a given Visual on ddpy
-static GLXFBConfig* match_fbconfig(XVisualInfo *vis)
+void PrimusInfo::initialize()
+{
+  // Opened here rather than at load, so that processes which never use GL,
+  // such as the shell scripts around an application, do not truncate them
+  profile_log.open();
+  tracer.open();
+  TraceScope scope("init");
+  double start = get_time();
+  contact_bumblebee();
+  primus.adpy = XOpenDisplay(getconf(PRIMUS_DISPLAY));
+  primus.ddpy = XOpenDisplay(NULL);
+  die_if(!primus.adpy, "failed to open secondary X display\n");
+  int ncfg, attrs[] = {GLX_DOUBLEBUFFER, GL_TRUE, None};
+  primus.dconfigs = primus.dfns.glXChooseFBConfig(primus.ddpy, 0, attrs, &ncfg);
+  assert(ncfg);
+  double elapsed = get_time() - start;
+  primus_perf("initialization took %.1f ms\n", elapsed * 1e3);
+  profile_log.record("init", "ms", elapsed * 1e3);
+}
+
+// Find an appropriate FBConfig on adpy for a given Visual on ddpy, or NULL
+static GLXFBConfig match_fbconfig(XVisualInfo *vis)
 {
+  ConfigMatch &m = primus.visual_configs[vis->visualid];
+  if (__atomic_load_n(&m.known, __ATOMIC_ACQUIRE))
+    return m.config;
   int ncfg, attrs[] = {
     GLX_DOUBLEBUFFER, 0, GLX_STEREO, 0, GLX_AUX_BUFFERS, 0,
     GLX_RED_SIZE, 0, GLX_GREEN_SIZE, 0, GLX_BLUE_SIZE, 0,
@@ -497,168 +3367,675 @@ static GLXFBConfig* match_fbconfig(XVisualInfo *vis)
   };
   for (int i = 0; attrs[i] != None; i += 2)
     primus.dfns.glXGetConfig(primus.ddpy, vis, attrs[i], &attrs[i+1]);
-  return primus.afns.glXChooseFBConfig(primus.adpy, 0, attrs, &ncfg);
+  GLXFBConfig *acfgs = primus.afns.glXChooseFBConfig(primus.adpy, 0, attrs, &ncfg);
+  GLXFBConfig config = acfgs && ncfg ? *acfgs : NULL;
+  XFree(acfgs);
+  m.config = config;
+  __atomic_store_n(&m.known, true, __ATOMIC_RELEASE);
+  return config;
 }
 
 GLXContext glXCreateContext(Display *dpy, XVisualInfo *vis, GLXContext shareList, Bool direct)
 {
-  GLXFBConfig *acfgs = match_fbconfig(vis);
-  GLXContext actx = primus.afns.glXCreateNewContext(primus.adpy, *acfgs, GLX_RGBA_TYPE, shareList, direct);
-  primus.contexts.record(actx, *acfgs, shareList);
+  primus.init();
+  GLXFBConfig acfg = match_fbconfig(vis);
+  if (!acfg)
+  {
+    primus_warn("glXCreateContext: no FBConfig matches visual 0x%lx\n", vis->visualid);
+    return NULL;
+  }
+  GLXContext actx = primus.afns.glXCreateNewContext(primus.adpy, acfg, GLX_RGBA_TYPE, shareList, direct);
+  if (!actx)
+    return NULL;
+  primus.contexts.record(actx, acfg, shareList);
   return actx;
 }
 
 GLXContext glXCreateNewContext(Display *dpy, GLXFBConfig config, int renderType, GLXContext shareList, Bool direct)
 {
+  primus.init();
   GLXContext actx = primus.afns.glXCreateNewContext(primus.adpy, config, renderType, shareList, direct);
+  if (!actx)
+    return NULL;
   primus.contexts.record(actx, config, shareList);
   return actx;
 }
 
+static void stop_drawable_pipeline(DrawableInfo &di)
+{
+  di.stop_pipeline();
+}
+
+static void stop_sharegroup_pipeline(DrawableInfo &di, int sharegroup)
+{
+  di.lock.lock();
+  if (di.pipelined && di.sharegroup == sharegroup)
+    di.stop_pipeline();
+  di.lock.unlock();
+}
+
 void glXDestroyContext(Display *dpy, GLXContext ctx)
 {
+  primus.init();
+  ContextInfo *ci = primus.contexts.find(ctx);
+  int dead = -1;
+  if (ci && !__atomic_sub_fetch(ci->sharegroup_contexts, 1, __ATOMIC_ACQ_REL))
+  {
+    dead = ci->sharegroup;
+    delete ci->sharegroup_contexts;
+  }
   primus.contexts.erase(ctx);
   // kludge: reap background tasks when deleting the last context
   // otherwise something will deadlock during unloading the library
   if (primus.contexts.empty())
-    for (DrawablesInfo::iterator i = primus.drawables.begin(); i != primus.drawables.end(); i++)
-      i->second.reap_workers();
+  {
+    primus.drawables.for_each(stop_drawable_pipeline);
+    primus.workers.stop();
+  }
+  else if (dead >= 0)
+  {
+    // Readback contexts sharing with the last context of the sharegroup would
+    // keep all its objects alive; pipelines restart on the next swap
+    primus.drawables.for_each(stop_sharegroup_pipeline, dead);
+    primus.workers.reap(dead);
+  }
   primus.afns.glXDestroyContext(primus.adpy, ctx);
 }
 
-static GLXPbuffer create_pbuffer(DrawableInfo &di)
+// A window dimension at a render scale, rounded to nearest
+static int scaled(int n, int scale)
+{
+  return (int)floor(n * scale / 100. + .5);
+}
+
+// Largest render scale of the drawable, which its allocation is sized for
+static int max_scale(const DrawableInfo &di)
+{
+  return di.kind == di.XWindow || di.kind == di.Window ? primus.scale : 100;
+}
+
+// Size frames are read back at: the drawable's size at its render scale, as
+// far as it fits in the allocation
+static void set_render_size(DrawableInfo &di)
+{
+  int width = scaled(di.width, di.scale), height = scaled(di.height, di.scale);
+  di.r.width = width < 1 ? 1 : width < di.alloc_width ? width : di.alloc_width;
+  di.r.height = height < 1 ? 1 : height < di.alloc_height ? height : di.alloc_height;
+  di.r.out_width = di.width;
+  di.r.out_height = di.height;
+}
+
+// Create the backing pbuffer, of the drawable's scaled size or larger
+static GLXPbuffer create_pbuffer(DrawableInfo &di, int width, int height)
 {
-  int pbattrs[] = {GLX_PBUFFER_WIDTH, di.width, GLX_PBUFFER_HEIGHT, di.height, GLX_PRESERVED_CONTENTS, True, None};
+  int pbattrs[] = {GLX_PBUFFER_WIDTH, width, GLX_PBUFFER_HEIGHT, height, GLX_PRESERVED_CONTENTS, True, None};
+  di.alloc_width = width;
+  di.alloc_height = height;
+  set_render_size(di);
   return primus.afns.glXCreatePbuffer(primus.adpy, di.fbconfig, pbattrs);
 }
 
-// return the parent of the given X window
-static Window get_parent(Display *dpy, Window w)
+// Size of the allocation for a dimension of a resized drawable: the current
+// one while it fits and is at most twice as large as needed, otherwise the
+// needed size rounded up to a multiple of 256
+static int size_class(int need, int cur)
 {
-  Window root, parent, *children;
-  unsigned int nchildren;
-  XQueryTree(dpy, w, &root, &parent, &children, &nchildren);
-  XFree(children);
-  return parent;
+  int rounded = (need + 255) & ~255;
+  if (rounded < 256)
+    rounded = 256;
+  return cur >= need && cur <= 2 * rounded ? cur : rounded;
+}
+
+// Approximate memory taken by a pbuffer
+static size_t pbuffer_bytes(GLXFBConfig config, int width, int height)
+{
+  int color = 32, depth = 0, stencil = 0, doublebuffer = 1, samples = 0;
+  primus.afns.glXGetFBConfigAttrib(primus.adpy, config, GLX_BUFFER_SIZE, &color);
+  primus.afns.glXGetFBConfigAttrib(primus.adpy, config, GLX_DEPTH_SIZE, &depth);
+  primus.afns.glXGetFBConfigAttrib(primus.adpy, config, GLX_STENCIL_SIZE, &stencil);
+  primus.afns.glXGetFBConfigAttrib(primus.adpy, config, GLX_DOUBLEBUFFER, &doublebuffer);
+  primus.afns.glXGetFBConfigAttrib(primus.adpy, config, GLX_SAMPLES, &samples);
+  size_t bits = (size_t)color * (doublebuffer ? 2 : 1) + depth + stencil;
+  return (size_t)width * height * (samples > 1 ? samples : 1) * bits / 8;
+}
+
+// Destroy the least recently used pbuffer kept for the window
+static void evict_pbuffer(DrawableInfo &di)
+{
+  DrawableInfo::CachedPbuffer &lru = di.cached[0];
+  primus_perf("0x%lx: evicting pbuffer of FBConfig %p\n", di.window, (void *)lru.fbconfig);
+  primus.afns.glXDestroyPbuffer(primus.adpy, lru.pbuffer);
+  memmove(&di.cached[0], &di.cached[1], (di.ncached - 1) * sizeof(di.cached[0]));
+  di.ncached--;
+}
+
+// Give the window a pbuffer of another FBConfig for a context it is made
+// current with, keeping the current one for switching back.  The readback
+// worker follows with a context of the new FBConfig in the same sharegroup, so
+// the pipeline keeps running.  Needs the drawable locked.
+static void switch_pbuffer(DrawableInfo &di, GLXFBConfig fbconfig)
+{
+  trace('i', "switch pbuffer", di.window);
+  DrawableInfo::CachedPbuffer next = {fbconfig, 0, 0, 0};
+  for (int i = 0; i < di.ncached; i++)
+    if (di.cached[i].fbconfig == fbconfig)
+    {
+      next = di.cached[i];
+      memmove(&di.cached[i], &di.cached[i + 1], (di.ncached - i - 1) * sizeof(di.cached[0]));
+      di.ncached--;
+      break;
+    }
+  DrawableInfo::CachedPbuffer prev = {di.fbconfig, di.pbuffer, di.alloc_width, di.alloc_height};
+  if (di.ncached == di.MAX_CACHED)
+    evict_pbuffer(di);
+  di.cached[di.ncached++] = prev;
+  // Evict least recently used ones beyond the budget
+  size_t total = 0, budget = (size_t)primus.pbuffer_cache_mb << 20;
+  for (int i = 0; i < di.ncached; i++)
+    total += pbuffer_bytes(di.cached[i].fbconfig, di.cached[i].width, di.cached[i].height);
+  while (di.ncached && total > budget)
+  {
+    total -= pbuffer_bytes(di.cached[0].fbconfig, di.cached[0].width, di.cached[0].height);
+    evict_pbuffer(di);
+  }
+  di.fbconfig = fbconfig;
+  // Frames along the pipeline have the size of the current allocation
+  if (next.pbuffer && (next.width != di.alloc_width || next.height != di.alloc_height))
+  {
+    primus.afns.glXDestroyPbuffer(primus.adpy, next.pbuffer);
+    next.pbuffer = 0;
+  }
+  di.pbuffer = next.pbuffer ? next.pbuffer : create_pbuffer(di, di.alloc_width, di.alloc_height);
+  __atomic_add_fetch(&di.pbuffer_gen, 1, __ATOMIC_RELEASE);
 }
 
-// Create or recall backing Pbuffer for the drawable
-static GLXPbuffer lookup_pbuffer(Display *dpy, GLXDrawable draw, GLXContext ctx)
+// Create or recall backing Pbuffer for the drawable; gen receives its
+// generation
+static GLXPbuffer lookup_pbuffer(Display *dpy, GLXDrawable draw, GLXContext ctx, unsigned *gen = NULL)
 {
+  if (gen)
+    *gen = 0;
   if (!draw)
     return 0;
-  bool known = primus.drawables.known(draw);
+  ContextInfo *ci = ctx ? primus.contexts.find(ctx) : NULL;
   DrawableInfo &di = primus.drawables[draw];
-  if (!known)
+  di.lock.lock();
+  if (!di.fbconfig)
   {
     // Drawable is a plain X Window. Get the FBConfig from the context
-    assert(ctx);
+    assert(ci);
     di.kind = di.XWindow;
-    di.fbconfig = primus.contexts[ctx].fbconfig;
+    di.fbconfig = ci->fbconfig;
     di.window = draw;
+    di.scale = primus.scale;
     note_geometry(dpy, draw, &di.width, &di.height);
-
-    // Disable compositing as long as the window containing this drawable is open: Set the property on all window up to, but excluding, the root
-    Window cur = draw;
-    while (Window parent = get_parent(dpy, cur)) {
-      // set the property on it
-      XChangeProperty(dpy, cur, XInternAtom(dpy, "_KDE_NET_WM_BLOCK_COMPOSITING", False),
-	  XA_ATOM, 32, PropModeReplace, NULL, 0);
-      // go up the tree
-      cur = parent;
-    }
   }
-  else if (ctx && di.fbconfig != primus.contexts[ctx].fbconfig)
+  else if (ci && di.fbconfig != ci->fbconfig && di.pbuffer && (di.kind == di.XWindow || di.kind == di.Window))
+    switch_pbuffer(di, ci->fbconfig);
+  else if (ci && di.fbconfig != ci->fbconfig)
   {
     if (di.pbuffer)
     {
       primus_warn("recreating incompatible pbuffer\n");
-      di.reap_workers();
+      di.stop_pipeline();
       primus.afns.glXDestroyPbuffer(primus.adpy, di.pbuffer);
       di.pbuffer = 0;
     }
-    di.fbconfig = primus.contexts[ctx].fbconfig;
+    di.fbconfig = ci->fbconfig;
   }
   if (!di.pbuffer)
-    di.pbuffer = create_pbuffer(di);
-  return di.pbuffer;
+  {
+    int scale = max_scale(di);
+    di.pbuffer = create_pbuffer(di, scaled(di.width, scale), scaled(di.height, scale));
+    __atomic_add_fetch(&di.pbuffer_gen, 1, __ATOMIC_RELEASE);
+  }
+  GLXPbuffer pbuffer = di.pbuffer;
+  if (gen)
+    *gen = di.pbuffer_gen;
+  di.lock.unlock();
+  return pbuffer;
+}
+
+// Whether windows may be rendered at less than their size
+static bool scaling()
+{
+  return primus.scale < 100 || primus.scale_target_ms > 0;
+}
+
+static ContextInfo *current_context_info()
+{
+  GLXContext ctx = primus.afns.glXGetCurrentContext();
+  return ctx ? primus.contexts.find(ctx) : NULL;
+}
+
+// Render scale of the framebuffer this thread draws to: that of the current
+// drawable while the default framebuffer is bound, otherwise 0
+static int bound_scale()
+{
+  DrawableInfo *di = tsdata.drawable ? tsdata.lookup(tsdata.drawable) : NULL;
+  if (!di)
+    return 0;
+  GLint fbo = 0;
+  primus.afns.glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &fbo);
+  return fbo ? 0 : di->scale;
+}
+
+// Apply a viewport or scissor box of the application at the render scale of
+// the bound framebuffer, rounding its edges, and note the scale
+static void set_scaled_rect(void (*set)(GLint, GLint, GLsizei, GLsizei), const GLint rect[4], int *rect_scale)
+{
+  int scale = *rect_scale = bound_scale();
+  if (!scale)
+    return set(rect[0], rect[1], rect[2], rect[3]);
+  int x = scaled(rect[0], scale), y = scaled(rect[1], scale);
+  set(x, y, scaled(rect[0] + rect[2], scale) - x, scaled(rect[1] + rect[3], scale) - y);
+}
+
+// Bring the viewport and scissor box of the current context in line with the
+// size and render scale of the current drawable
+static void rescale_context()
+{
+  ContextInfo *ci = current_context_info();
+  DrawableInfo *di = tsdata.drawable ? tsdata.lookup(tsdata.drawable) : NULL;
+  if (!ci || !di)
+    return;
+  if (!ci->made_current)
+  {
+    // GL initializes both to the size of the pbuffer, which may be larger
+    // than the window
+    const GLint rect[4] = {0, 0, di->width, di->height};
+    memcpy(ci->viewport, rect, sizeof(rect));
+    memcpy(ci->scissor, rect, sizeof(rect));
+    ci->viewport_scale = ci->scissor_scale = -1;
+    ci->made_current = true;
+    if (!scaling() && (di->alloc_width != di->width || di->alloc_height != di->height))
+    {
+      primus.afns.glViewport(0, 0, di->width, di->height);
+      primus.afns.glScissor(0, 0, di->width, di->height);
+    }
+  }
+  if (!scaling())
+    return;
+  int scale = bound_scale();
+  if (!scale)
+    return;
+  if (ci->viewport_scale && ci->viewport_scale != scale)
+    set_scaled_rect(primus.afns.glViewport, ci->viewport, &ci->viewport_scale);
+  if (ci->scissor_scale && ci->scissor_scale != scale)
+    set_scaled_rect(primus.afns.glScissor, ci->scissor, &ci->scissor_scale);
+}
+
+void glViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+  ContextInfo *ci = scaling() ? current_context_info() : NULL;
+  if (!ci)
+    return primus.afns.glViewport(x, y, width, height);
+  const GLint rect[4] = {x, y, width, height};
+  memcpy(ci->viewport, rect, sizeof(rect));
+  set_scaled_rect(primus.afns.glViewport, ci->viewport, &ci->viewport_scale);
+}
+
+void glScissor(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+  ContextInfo *ci = scaling() ? current_context_info() : NULL;
+  if (!ci)
+    return primus.afns.glScissor(x, y, width, height);
+  const GLint rect[4] = {x, y, width, height};
+  memcpy(ci->scissor, rect, sizeof(rect));
+  set_scaled_rect(primus.afns.glScissor, ci->scissor, &ci->scissor_scale);
+}
+
+// The viewport or scissor box of the current context as the application set
+// it, unless GL holds it unscaled
+static const GLint *unscaled_rect(GLenum pname)
+{
+  if (!scaling() || (pname != GL_VIEWPORT && pname != GL_SCISSOR_BOX))
+    return NULL;
+  ContextInfo *ci = current_context_info();
+  if (!ci)
+    return NULL;
+  if (pname == GL_VIEWPORT)
+    return ci->viewport_scale ? ci->viewport : NULL;
+  return ci->scissor_scale ? ci->scissor : NULL;
+}
+
+template<typename T>
+static bool get_unscaled_rect(GLenum pname, T *params)
+{
+  const GLint *rect = unscaled_rect(pname);
+  if (!rect)
+    return false;
+  for (int i = 0; i < 4; i++)
+    params[i] = rect[i];
+  return true;
+}
+
+void glGetIntegerv(GLenum pname, GLint *params)
+{
+  if (!get_unscaled_rect(pname, params))
+    primus.afns.glGetIntegerv(pname, params);
+}
+
+void glGetFloatv(GLenum pname, GLfloat *params)
+{
+  if (!get_unscaled_rect(pname, params))
+    primus.afns.glGetFloatv(pname, params);
+}
+
+void glGetDoublev(GLenum pname, GLdouble *params)
+{
+  if (!get_unscaled_rect(pname, params))
+    primus.afns.glGetDoublev(pname, params);
 }
 
 Bool glXMakeCurrent(Display *dpy, GLXDrawable drawable, GLXContext ctx)
 {
-  GLXPbuffer pbuffer = lookup_pbuffer(dpy, drawable, ctx);
-  tsdata.make_current(dpy, drawable, drawable);
-  return primus.afns.glXMakeCurrent(primus.adpy, pbuffer, ctx);
+  primus.init();
+  unsigned gen;
+  GLXPbuffer pbuffer = lookup_pbuffer(dpy, drawable, ctx, &gen);
+  tsdata.make_current(dpy, drawable, drawable, gen, gen);
+  Bool r = primus.afns.glXMakeCurrent(primus.adpy, pbuffer, ctx);
+  if (r)
+    rescale_context();
+  return r;
 }
 
 Bool glXMakeContextCurrent(Display *dpy, GLXDrawable draw, GLXDrawable read, GLXContext ctx)
 {
+  primus.init();
   if (draw == read)
     return glXMakeCurrent(dpy, draw, ctx);
-  GLXPbuffer pbuffer = lookup_pbuffer(dpy, draw, ctx);
-  GLXPbuffer pb_read = lookup_pbuffer(dpy, read, ctx);
-  tsdata.make_current(dpy, draw, read);
-  return primus.afns.glXMakeContextCurrent(primus.adpy, pbuffer, pb_read, ctx);
+  unsigned draw_gen, read_gen;
+  GLXPbuffer pbuffer = lookup_pbuffer(dpy, draw, ctx, &draw_gen);
+  GLXPbuffer pb_read = lookup_pbuffer(dpy, read, ctx, &read_gen);
+  tsdata.make_current(dpy, draw, read, draw_gen, read_gen);
+  Bool r = primus.afns.glXMakeContextCurrent(primus.adpy, pbuffer, pb_read, ctx);
+  if (r)
+    rescale_context();
+  return r;
 }
 
-void glXSwapBuffers(Display *dpy, GLXDrawable drawable)
+// Bind the pbuffers that replaced ones current in this thread
+static void rebind_stale()
+{
+  if (!tsdata.stale())
+    return;
+  trace('i', "rebind pbuffer", tsdata.drawable);
+  glXMakeContextCurrent(tsdata.dpy, tsdata.drawable, tsdata.read_drawable, glXGetCurrentContext());
+}
+
+// With PRIMUS_SCALE_TARGET_MS, adjust the render scale of the window so that
+// the application's average time per frame approaches the target, taking the
+// cost of a frame to grow with its area.  The scale changes in 5% steps at
+// most twice a second and stays put while the frame time is within 80% and
+// 100% of the target; returns whether it changed.
+static bool adapt_scale(DrawableInfo &di, double now)
+{
+  if (primus.scale_target_ms <= 0)
+    return false;
+  double ms = (now - di.frame_start) * 1e3;
+  if (!di.frame_start || ms > 1000)
+    return false; // first frame, or a pause rather than load
+  di.frame_ms = di.frame_ms ? .9 * di.frame_ms + .1 * ms : ms;
+  double ratio = primus.scale_target_ms / di.frame_ms;
+  if (now - di.scale_time < .5 || (ratio >= 1 && ratio <= 1.25))
+    return false;
+  const int min_scale = primus.scale < 50 ? primus.scale : 50;
+  int scale = (int)(di.scale * sqrt(ratio)) / 5 * 5;
+  scale = scale < min_scale ? min_scale : scale > primus.scale ? primus.scale : scale;
+  if (scale == di.scale)
+    return false;
+  primus_perf("0x%lx: rendering at %d%% for %.1f ms per frame\n", di.window, scale, di.frame_ms);
+  trace('i', "scale change", di.window);
+  di.scale = scale;
+  di.scale_time = now;
+  di.frame_ms = 0;
+  return true;
+}
+
+// Hold the application until its next frame is due by the swap interval or
+// PRIMUS_FPS_LIMIT.  Sleeps until shortly before the deadline, then spins, as
+// wakeups from sleep are too imprecise for steady pacing.  Returns how long
+// the application was held.
+static double pace_swap(DrawableInfo &di)
+{
+  double period = 0;
+  if (di.swap_request > 1)
+  {
+    long refresh_ns = __atomic_load_n(&di.refresh_ns, __ATOMIC_RELAXED);
+    period = (di.swap_request - 1) * (refresh_ns ? refresh_ns * 1e-9 : 1 / 60.);
+  }
+  if (primus.fps_limit > 0 && 1 / primus.fps_limit > period)
+    period = 1 / primus.fps_limit;
+  if (primus.hidden_fps > 0 && 1 / primus.hidden_fps > period && __atomic_load_n(&di.hidden, __ATOMIC_RELAXED))
+    period = 1 / primus.hidden_fps;
+  double now = get_time(), start = now;
+  if (!period)
+  {
+    di.deadline = 0;
+    di.lateness = -1;
+    return 0;
+  }
+  if (!di.deadline || now - di.deadline > period)
+  {
+    // Missed by more than a frame: start over instead of catching up
+    di.lateness = di.deadline ? now - di.deadline : 0;
+    di.deadline = now + period;
+    return 0;
+  }
+  const double spin = 2e-4;
+  if (di.deadline - now > spin)
+  {
+    TraceScope scope("pace", di.window);
+    double sleep_until = di.deadline - spin;
+    struct timespec tp;
+    tp.tv_sec = (time_t)sleep_until;
+    tp.tv_nsec = (long)((sleep_until - tp.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tp, NULL) == EINTR);
+  }
+  while ((now = get_time()) < di.deadline);
+  di.lateness = now - di.deadline;
+  di.deadline += period;
+  return now - start;
+}
+
+// Have the readback worker read back the window's back buffer, or only the
+// given rectangle of it, and wait until it has issued the readback; returns
+// the current context.  Needs the drawable locked.
+static GLXContext read_back(DrawableInfo &di, GLXDrawable drawable, const char *caller, const int *rect)
 {
-  assert(primus.drawables.known(drawable));
-  DrawableInfo &di = primus.drawables[drawable];
-  if (di.kind == di.Pbuffer || di.kind == di.Pixmap)
-    return primus.afns.glXSwapBuffers(primus.adpy, di.pbuffer);
   GLXContext ctx = glXGetCurrentContext();
   if (!ctx)
-    primus_warn("glXSwapBuffers: no current context\n");
-  if (di.r.worker && di.actx && ctx && primus.contexts[di.actx].sharegroup != primus.contexts[ctx].sharegroup)
+    primus_warn("%s: no current context\n", caller);
+  ContextInfo *ci = ctx ? primus.contexts.find(ctx) : NULL;
+  int sharegroup = ci ? ci->sharegroup : -1;
+  // A fence is only visible to the readback context if it is in the same
+  // sharegroup.  Another thread rendering to the drawable with an unrelated
+  // context finishes its rendering instead; the thread that started the
+  // pipeline restarts it, as it presumably switched contexts for good.
+  bool unshared = di.pipelined && ctx && sharegroup != di.sharegroup;
+  if (unshared && pthread_equal(pthread_self(), di.owner))
   {
-    primus_warn("glXSwapBuffers: respawning threads after context change\n");
-    di.reap_workers();
+    unshared = false;
+    primus_warn("%s: restarting pipeline after context change\n", caller);
+    di.stop_pipeline();
   }
-  if (!di.r.worker)
+  if (!di.pipelined)
   {
-    // Need to create a sharing context to use GL sync objects
+    // Readback needs a sharing context to use GL sync objects
     di.actx = ctx;
-    di.d.spawn_worker(drawable, display_work);
-    di.r.spawn_worker(drawable, readback_work);
+    di.sharegroup = sharegroup;
+    di.owner = pthread_self();
+    di.start_pipeline(primus.queue_depth);
   }
+  if (rect && !di.skipped)
+    memcpy(di.r.sub, rect, sizeof(di.r.sub));
+  else
+    di.r.sub[2] = di.r.sub[3] = 0;
+  di.skipped = false;
   // Readback thread needs a sync object to avoid reading an incomplete frame
-  di.sync = primus.afns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-  sem_post(&di.r.acqsem); // Signal the readback worker thread
+  if (unshared)
+    primus.afns.glFinish();
+  di.sync = unshared ? 0 : primus.afns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  trace('i', "fence", drawable);
+  di.swap_time = get_time();
+  primus.workers.readback[di.worker].jobs.push(&di); // Signal the readback worker
+  trace('B', "wait for readback", drawable);
   sem_wait(&di.r.relsem); // Wait until it has issued glReadBuffer
-  primus.afns.glDeleteSync(di.sync);
+  trace('E', "wait for readback", drawable);
+  if (di.sync)
+    primus.afns.glDeleteSync(di.sync);
+  return ctx;
+}
+
+void glXSwapBuffers(Display *dpy, GLXDrawable drawable)
+{
+  primus.init();
+  TraceScope scope("glXSwapBuffers", drawable);
+  DrawableInfo *pdi = tsdata.lookup(drawable);
+  assert(pdi);
+  DrawableInfo &di = *pdi;
+  if (di.kind == di.Pbuffer || di.kind == di.Pixmap)
+    return primus.afns.glXSwapBuffers(primus.adpy, di.pbuffer);
+  di.lock.lock();
+  if (drawable == tsdata.drawable && tsdata.draw_pbuffer_gen != di.pbuffer_gen)
+  {
+    // Another thread replaced the pbuffer this frame was rendered to
+    di.lock.unlock();
+    return rebind_stale();
+  }
+  if (di.pipelined && __atomic_load_n(&di.hidden, __ATOMIC_RELAXED))
+  {
+    // Nobody would see the frame
+    trace('i', "hidden", drawable);
+    di.skipped = true;
+    di.swap_time = get_time();
+    primus.afns.glXSwapBuffers(primus.adpy, di.pbuffer);
+    di.frame_start = di.swap_time + pace_swap(di);
+    di.lock.unlock();
+    return;
+  }
+  read_back(di, drawable, "glXSwapBuffers", NULL);
   primus.afns.glXSwapBuffers(primus.adpy, di.pbuffer);
+  bool rescaled = adapt_scale(di, di.swap_time);
   if (di.reinit == di.RESIZE)
   {
-    primus.afns.glXDestroyPbuffer(primus.adpy, di.pbuffer);
-    di.pbuffer = create_pbuffer(di);
-    if (ctx) // FIXME: drawable can be current in other threads
-      glXMakeContextCurrent(dpy, tsdata.drawable, tsdata.read_drawable, ctx);
-    di.r.reinit = di.reinit;
     di.reinit = di.NONE;
+    // Allocate for the largest scale, so that adapting it does not reallocate
+    int scale = max_scale(di);
+    int width = size_class(scaled(di.width, scale), di.alloc_width);
+    int height = size_class(scaled(di.height, scale), di.alloc_height);
+    if (width != di.alloc_width || height != di.alloc_height)
+    {
+      trace('i', "reallocate pbuffer", drawable);
+      primus.afns.glXDestroyPbuffer(primus.adpy, di.pbuffer);
+      di.pbuffer = create_pbuffer(di, width, height);
+      // Threads that have the drawable current rebind on their next swap or
+      // glXMakeCurrent; until then the old pbuffer stays alive for them
+      __atomic_add_fetch(&di.pbuffer_gen, 1, __ATOMIC_RELEASE);
+      di.r.reinit = di.RESIZE;
+    }
+    else
+    {
+      // Fits in the allocation: just read back less or more of it
+      set_render_size(di);
+    }
+  }
+  else if (rescaled)
+    set_render_size(di);
+  // Time spent pacing does not count towards the application's frame time
+  di.frame_start = di.swap_time + pace_swap(di);
+  di.lock.unlock();
+  rebind_stale();
+  if (rescaled)
+    rescale_context();
+}
+
+// Show a rectangle of the back buffer without swapping.  Only the rectangle
+// is read back, into the buffer with the previous frame, and only tiles it
+// overlaps are uploaded.
+void glXCopySubBufferMESA(Display *dpy, GLXDrawable drawable, int x, int y, int width, int height)
+{
+  primus.init();
+  TraceScope scope("glXCopySubBufferMESA", drawable);
+  DrawableInfo *di = tsdata.lookup(drawable);
+  if (!di || (di->kind != di->XWindow && di->kind != di->Window) || width <= 0 || height <= 0)
+    return;
+  di->lock.lock();
+  if (drawable == tsdata.drawable && tsdata.draw_pbuffer_gen != di->pbuffer_gen)
+  {
+    // Another thread replaced the pbuffer this frame was rendered to
+    di->lock.unlock();
+    return rebind_stale();
+  }
+  // In the pbuffer, which may be scaled, rounding outwards
+  int x0 = (int)floor(x * di->scale / 100.), y0 = (int)floor(y * di->scale / 100.);
+  int x1 = (int)ceil((x + width) * di->scale / 100.), y1 = (int)ceil((y + height) * di->scale / 100.);
+  x0 = x0 < 0 ? 0 : x0;
+  y0 = y0 < 0 ? 0 : y0;
+  x1 = x1 > di->r.width ? di->r.width : x1;
+  y1 = y1 > di->r.height ? di->r.height : y1;
+  if (di->pipelined && __atomic_load_n(&di->hidden, __ATOMIC_RELAXED))
+    di->skipped = true;
+  else if (x0 < x1 && y0 < y1)
+  {
+    const int rect[4] = {x0, y0, x1 - x0, y1 - y0};
+    read_back(*di, drawable, "glXCopySubBufferMESA", rect);
   }
+  di->lock.unlock();
 }
 
 GLXWindow glXCreateWindow(Display *dpy, GLXFBConfig config, Window win, const int *attribList)
 {
+  primus.init();
   GLXWindow glxwin = primus.dfns.glXCreateWindow(primus.ddpy, primus.dconfigs[0], win, attribList);
+  if (!glxwin)
+    return 0;
   DrawableInfo &di = primus.drawables[glxwin];
   di.kind = di.Window;
   di.fbconfig = config;
   di.window = win;
+  di.scale = primus.scale;
   note_geometry(dpy, win, &di.width, &di.height);
   return glxwin;
 }
 
+void DrawableInfo::start_pipeline(int depth)
+{
+  queue.init(depth - 1);
+  mailbox.reset();
+  sem_init(&r.relsem, 0, 0);
+  r.reinit = RESIZE;
+  worker = primus.workers.assign(readback_work, display_work);
+  pipelined = true;
+}
+
+void DrawableInfo::stop_pipeline()
+{
+  if (!pipelined)
+    return;
+  r.reinit = SHUTDOWN;
+  primus.workers.readback[worker].jobs.push(this);
+  sem_wait(&r.relsem);
+  primus.workers.release(worker);
+  sem_destroy(&r.relsem);
+  queue.destroy();
+  mailbox.resize_tiles(0);
+  pipelined = false;
+}
+
 DrawableInfo::~DrawableInfo()
 {
-  reap_workers();
+  stop_pipeline();
   if (pbuffer)
     primus.afns.glXDestroyPbuffer(primus.adpy, pbuffer);
+  for (int i = 0; i < ncached; i++)
+    primus.afns.glXDestroyPbuffer(primus.adpy, cached[i].pbuffer);
 }
 
 void glXDestroyWindow(Display *dpy, GLXWindow window)
 {
+  primus.init();
   assert(primus.drawables.known(window));
   primus.drawables.erase(window);
   primus.dfns.glXDestroyWindow(primus.ddpy, window);
@@ -666,10 +4043,14 @@ void glXDestroyWindow(Display *dpy, GLXWindow window)
 
 GLXPbuffer glXCreatePbuffer(Display *dpy, GLXFBConfig config, const int *attribList)
 {
+  primus.init();
   GLXPbuffer pbuffer = primus.dfns.glXCreatePbuffer(primus.ddpy, primus.dconfigs[0], attribList);
+  if (!pbuffer)
+    return 0;
   DrawableInfo &di = primus.drawables[pbuffer];
   di.kind = di.Pbuffer;
   di.fbconfig = config;
+  di.scale = 100;
   for (int i = 0; attribList[i] != None; i++)
     if (attribList[i] == GLX_PBUFFER_WIDTH)
       di.width = attribList[i+1];
@@ -680,6 +4061,7 @@ GLXPbuffer glXCreatePbuffer(Display *dpy, GLXFBConfig config, const int *attribL
 
 void glXDestroyPbuffer(Display *dpy, GLXPbuffer pbuf)
 {
+  primus.init();
   assert(primus.drawables.known(pbuf));
   primus.drawables.erase(pbuf);
   primus.dfns.glXDestroyPbuffer(primus.ddpy, pbuf);
@@ -687,16 +4069,21 @@ void glXDestroyPbuffer(Display *dpy, GLXPbuffer pbuf)
 
 GLXPixmap glXCreatePixmap(Display *dpy, GLXFBConfig config, Pixmap pixmap, const int *attribList)
 {
+  primus.init();
   GLXPixmap glxpix = primus.dfns.glXCreatePixmap(dpy, primus.dconfigs[0], pixmap, attribList);
+  if (!glxpix)
+    return 0;
   DrawableInfo &di = primus.drawables[glxpix];
   di.kind = di.Pixmap;
   di.fbconfig = config;
+  di.scale = 100;
   note_geometry(dpy, pixmap, &di.width, &di.height);
   return glxpix;
 }
 
 void glXDestroyPixmap(Display *dpy, GLXPixmap pixmap)
 {
+  primus.init();
   assert(primus.drawables.known(pixmap));
   primus.drawables.erase(pixmap);
   primus.dfns.glXDestroyPixmap(dpy, pixmap);
@@ -704,70 +4091,119 @@ void glXDestroyPixmap(Display *dpy, GLXPixmap pixmap)
 
 GLXPixmap glXCreateGLXPixmap(Display *dpy, XVisualInfo *visual, Pixmap pixmap)
 {
+  primus.init();
+  GLXFBConfig acfg = match_fbconfig(visual);
+  if (!acfg)
+  {
+    primus_warn("glXCreateGLXPixmap: no FBConfig matches visual 0x%lx\n", visual->visualid);
+    return 0;
+  }
   GLXPixmap glxpix = primus.dfns.glXCreateGLXPixmap(primus.ddpy, visual, pixmap);
+  if (!glxpix)
+    return 0;
   DrawableInfo &di = primus.drawables[glxpix];
   di.kind = di.Pixmap;
+  di.scale = 100;
   note_geometry(dpy, pixmap, &di.width, &di.height);
-  GLXFBConfig *acfgs = match_fbconfig(visual);
-  di.fbconfig = *acfgs;
+  di.fbconfig = acfg;
   return glxpix;
 }
 
 void glXDestroyGLXPixmap(Display *dpy, GLXPixmap pixmap)
 {
+  primus.init();
   glXDestroyPixmap(primus.ddpy, pixmap);
 }
 
-static XVisualInfo *match_visual(int attrs[])
+// ID of a Visual on ddpy with exactly the given attributes, or 0
+static VisualID match_visual(int attrs[])
 {
   XVisualInfo *vis = glXChooseVisual(primus.ddpy, 0, attrs);
-  for (int i = 2; attrs[i] != None && vis; i += 2)
+  VisualID visualid = vis ? vis->visualid : 0;
+  for (int i = 2; attrs[i] != None && visualid; i += 2)
   {
     int tmp = attrs[i+1];
     primus.dfns.glXGetConfig(primus.ddpy, vis, attrs[i], &attrs[i+1]);
     if (tmp != attrs[i+1])
-      vis = NULL;
+      visualid = 0;
   }
-  return vis;
+  XFree(vis);
+  return visualid;
 }
 
-XVisualInfo *glXGetVisualFromFBConfig(Display *dpy, GLXFBConfig config)
+// ID of the Visual on ddpy that best matches an FBConfig on adpy, or 0 if the
+// FBConfig has no visual.  Toolkits query this for every FBConfig, so the
+// up to ten glXChooseVisual round trips it takes are done once per FBConfig.
+static VisualID config_visual(GLXFBConfig config)
 {
-  if (!primus.afns.glXGetVisualFromFBConfig(primus.adpy, config))
-    return NULL;
-  int i, attrs[] = {
-    GLX_RGBA, GLX_DOUBLEBUFFER,
-    GLX_RED_SIZE, 0, GLX_GREEN_SIZE, 0, GLX_BLUE_SIZE, 0,
-    GLX_ALPHA_SIZE, 0, GLX_DEPTH_SIZE, 0, GLX_STENCIL_SIZE, 0,
-    GLX_SAMPLE_BUFFERS, 0, GLX_SAMPLES, 0, None
-  };
-  for (i = 2; attrs[i] != None; i += 2)
-    primus.afns.glXGetFBConfigAttrib(primus.adpy, config, attrs[i], &attrs[i+1]);
-  XVisualInfo *vis = NULL;
-  for (i -= 2; i >= 0 && !vis; i -= 2)
+  ConfigMatch &m = primus.config_visuals[config];
+  if (__atomic_load_n(&m.known, __ATOMIC_ACQUIRE))
+    return m.visualid;
+  VisualID visualid = 0;
+  if (XVisualInfo *avis = primus.afns.glXGetVisualFromFBConfig(primus.adpy, config))
   {
-    vis = match_visual(attrs);
-    attrs[i] = None;
+    XFree(avis);
+    int i, attrs[] = {
+      GLX_RGBA, GLX_DOUBLEBUFFER,
+      GLX_RED_SIZE, 0, GLX_GREEN_SIZE, 0, GLX_BLUE_SIZE, 0,
+      GLX_ALPHA_SIZE, 0, GLX_DEPTH_SIZE, 0, GLX_STENCIL_SIZE, 0,
+      GLX_SAMPLE_BUFFERS, 0, GLX_SAMPLES, 0, None
+    };
+    for (i = 2; attrs[i] != None; i += 2)
+      primus.afns.glXGetFBConfigAttrib(primus.adpy, config, attrs[i], &attrs[i+1]);
+    for (i -= 2; i >= 0 && !visualid; i -= 2)
+    {
+      visualid = match_visual(attrs);
+      attrs[i] = None;
+    }
   }
-  return vis;
+  // Threads racing to fill the match find the same one
+  m.visualid = visualid;
+  __atomic_store_n(&m.known, true, __ATOMIC_RELEASE);
+  return visualid;
+}
+
+XVisualInfo *glXGetVisualFromFBConfig(Display *dpy, GLXFBConfig config)
+{
+  primus.init();
+  XVisualInfo tmpl;
+  int n;
+  tmpl.visualid = config_visual(config);
+  // Xlib keeps the visuals of each screen, so this is a local lookup; the
+  // application frees the copy with XFree
+  return tmpl.visualid ? XGetVisualInfo(dpy, VisualIDMask, &tmpl, &n) : NULL;
 }
 
 int glXGetFBConfigAttrib(Display *dpy, GLXFBConfig config, int attribute, int *value)
 {
+  primus.init();
   int r = primus.afns.glXGetFBConfigAttrib(primus.adpy, config, attribute, value);
   if (attribute == GLX_VISUAL_ID && *value)
-    return primus.dfns.glXGetConfig(primus.ddpy, glXGetVisualFromFBConfig(dpy, config), attribute, value);
+    *value = config_visual(config);
   return r;
 }
 
 void glXQueryDrawable(Display *dpy, GLXDrawable draw, int attribute, unsigned int *value)
 {
-  assert(primus.drawables.known(draw));
-  primus.afns.glXQueryDrawable(primus.adpy, lookup_pbuffer(dpy, draw, NULL), attribute, value);
+  primus.init();
+  DrawableInfo *di = primus.drawables.find(draw);
+  assert(di);
+  GLXPbuffer pbuffer = lookup_pbuffer(dpy, draw, NULL);
+  // Backing pbuffer may be larger or, with a render scale, smaller than the
+  // window; the application sees the window size
+  if ((di->kind == di->XWindow || di->kind == di->Window) && (attribute == GLX_WIDTH || attribute == GLX_HEIGHT))
+    *value = attribute == GLX_WIDTH ? di->r.out_width : di->r.out_height;
+  else if (attribute == GLX_SWAP_INTERVAL_EXT)
+    *value = di->swap_request ? di->swap_request - 1 : 0;
+  else if (attribute == GLX_MAX_SWAP_INTERVAL_EXT)
+    *value = 8;
+  else
+    primus.afns.glXQueryDrawable(primus.adpy, pbuffer, attribute, value);
 }
 
 void glXUseXFont(Font font, int first, int count, int list)
 {
+  primus.init();
   unsigned long prop;
   XFontStruct *fs = XQueryFont(primus.ddpy, font);
   XGetFontProperty(fs, XA_FONT, &prop);
@@ -781,6 +4217,7 @@ void glXUseXFont(Font font, int first, int count, int list)
 
 GLXContext glXGetCurrentContext(void)
 {
+  primus.init();
   return primus.afns.glXGetCurrentContext();
 }
 
@@ -810,18 +4247,20 @@ GLXDrawable glXGetCurrentReadDrawable(void)
 // Application sees ddpy-side Visuals, but adpy-side FBConfigs and Contexts
 XVisualInfo* glXChooseVisual(Display *dpy, int screen, int *attribList)
 {
+  primus.init();
   return primus.dfns.glXChooseVisual(dpy, screen, attribList);
 }
 
 int glXGetConfig(Display *dpy, XVisualInfo *visual, int attrib, int *value)
 {
+  primus.init();
   return primus.dfns.glXGetConfig(dpy, visual, attrib, value);
 }
 
 // GLX forwarders that reroute to adpy
 #define DEF_GLX_PROTO(ret, name, par, ...) \
 ret name par \
-{ return primus.afns.name(primus.adpy, __VA_ARGS__); }
+{ primus.init(); return primus.afns.name(primus.adpy, __VA_ARGS__); }
 #include "glx-dpyredir.def"
 #undef DEF_GLX_PROTO
 
@@ -838,57 +4277,182 @@ static void *i##name(void) \
 
 // GLX extensions
 
+// Swap intervals are honored by pacing the application in glXSwapBuffers and
+// are passed on to the display worker's presents.  A window not seen yet gets
+// its entry here, and keeps the interval once made current.
+static void set_swap_interval(GLXDrawable drawable, int interval)
+{
+  DrawableInfo &di = primus.drawables[drawable];
+  __atomic_store_n(&di.swap_request, interval + 1, __ATOMIC_RELAXED);
+}
+
+// Report an X error for a GLX request that primus handles itself, as the GLX
+// client library does
+static void glx_error(Display *dpy, unsigned char code, XID resource, int minor)
+{
+  int opcode = 0, event, error;
+  XQueryExtension(dpy, "GLX", &opcode, &event, &error);
+  xError err;
+  memset(&err, 0, sizeof(err));
+  LockDisplay(dpy);
+  err.type = X_Error;
+  err.errorCode = code;
+  err.sequenceNumber = dpy->request;
+  err.resourceID = resource;
+  err.majorCode = opcode;
+  err.minorCode = minor;
+  _XError(dpy, &err);
+  UnlockDisplay(dpy);
+}
+
+// SGI_swap_control cannot turn swap intervals off
 int glXSwapIntervalSGI(int interval)
 {
-  return 1; // Indicate failure to set swapinterval
+  if (interval <= 0)
+    return GLX_BAD_VALUE;
+  if (!tsdata.drawable)
+    return GLX_BAD_CONTEXT;
+  set_swap_interval(tsdata.drawable, interval);
+  return 0;
 }
 
-__GLXextFuncPtr glXGetProcAddress(const GLubyte *procName)
+// Negative (adaptive) intervals need EXT_swap_control_tear, which primus does
+// not offer
+void glXSwapIntervalEXT(Display *dpy, GLXDrawable drawable, int interval)
 {
-  static const char * const redefined_names[] = {
-#define DEF_GLX_PROTO(ret, name, args, ...) #name,
-#include "glx-reimpl.def"
-#include "glxext-reimpl.def"
-#include "glx-dpyredir.def"
-#undef  DEF_GLX_PROTO
-  };
-  static const __GLXextFuncPtr redefined_fns[] = {
-#define DEF_GLX_PROTO(ret, name, args, ...) (__GLXextFuncPtr)name,
+  enum {X_GLXvop_SwapIntervalEXT = 1416};
+  if (interval < 0)
+    return glx_error(dpy, BadValue, interval, X_GLXvop_SwapIntervalEXT);
+  if (!drawable)
+    return glx_error(dpy, BadWindow, drawable, X_GLXvop_SwapIntervalEXT);
+  set_swap_interval(drawable, interval);
+}
+
+int glXSwapIntervalMESA(unsigned int interval)
+{
+  if ((int)interval < 0)
+    return GLX_BAD_VALUE;
+  if (!tsdata.drawable)
+    return GLX_BAD_CONTEXT;
+  set_swap_interval(tsdata.drawable, interval);
+  return 0;
+}
+
+// Windows without a swap interval set are not paced, so they report 0
+int glXGetSwapIntervalMESA(void)
+{
+  DrawableInfo *di = tsdata.drawable ? primus.drawables.find(tsdata.drawable) : NULL;
+  return di && di->swap_request ? di->swap_request - 1 : 0;
+}
+
+// FNV-1a, also usable in constant expressions
+static constexpr unsigned name_hash(const char *s, unsigned h = 2166136261u)
+{
+  return *s ? name_hash(s + 1, (h ^ (unsigned char)*s) * 16777619u) : h;
+}
+
+// GLX and GL functions implemented in primus; duplicate case labels would
+// make hash collisions among them a compile error
+static __GLXextFuncPtr redefined_proc(const char *procName)
+{
+  switch (name_hash(procName))
+  {
+#define DEF_GLX_PROTO(ret, name, args, ...) \
+    case name_hash(#name): return strcmp(procName, #name) ? NULL : (__GLXextFuncPtr)name;
 #include "glx-reimpl.def"
 #include "glxext-reimpl.def"
 #include "glx-dpyredir.def"
+#include "gl-reimpl.def"
 #undef  DEF_GLX_PROTO
-  };
-  enum {n_redefined = sizeof(redefined_fns) / sizeof(redefined_fns[0])};
-  // Non-GLX functions are forwarded to the accelerating libGL
-  if (memcmp(procName, "glX", 3))
-    return primus.afns.glXGetProcAddress(procName);
-  // All GLX functions are either implemented in primus or not available
-  for (int i = 0; i < n_redefined; i++)
-    if (!strcmp((const char *)procName, redefined_names[i]))
-      return redefined_fns[i];
+  }
   return NULL;
 }
 
+struct ForwardedProc {
+  const char *name; // NULL until filled in
+  __GLXextFuncPtr fn;
+  ForwardedProc(): name(NULL), fn(NULL) {}
+  ~ForwardedProc()
+  {
+    free((void *)name);
+  }
+};
+
+// Entry points obtained from the accelerating libGL, keyed by name hash; of
+// names with equal hashes, only the first one looked up is cached
+static struct ForwardedProcs: public Registry<uintptr_t, ForwardedProc> {
+  pthread_mutex_t fill_lock;
+  ForwardedProcs()
+  {
+    pthread_mutex_init(&fill_lock, NULL);
+  }
+  static uintptr_t key(const char *name)
+  {
+    return name_hash(name) | 1;
+  }
+  bool lookup(const char *name, __GLXextFuncPtr *fn) const
+  {
+    ForwardedProc *fp = find(key(name));
+    const char *cached = fp ? __atomic_load_n(&fp->name, __ATOMIC_ACQUIRE) : NULL;
+    if (!cached || strcmp(cached, name))
+      return false;
+    *fn = fp->fn;
+    return true;
+  }
+  void record(const char *name, __GLXextFuncPtr fn)
+  {
+    ForwardedProc &fp = (*this)[key(name)];
+    pthread_mutex_lock(&fill_lock);
+    if (!fp.name)
+    {
+      fp.fn = fn;
+      __atomic_store_n(&fp.name, (const char *)strdup(name), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&fill_lock);
+  }
+} forwarded_procs;
+
+__GLXextFuncPtr glXGetProcAddress(const GLubyte *procName)
+{
+  const char *name = (const char *)procName;
+  // All GLX functions are either implemented in primus or not available
+  if (!memcmp(name, "glX", 3))
+    return redefined_proc(name);
+  // Other functions are forwarded to the accelerating libGL, unless primus
+  // implements them
+  __GLXextFuncPtr fn;
+  if (!forwarded_procs.lookup(name, &fn))
+  {
+    if (!(fn = redefined_proc(name)))
+      fn = primus.afns.glXGetProcAddress(procName);
+    forwarded_procs.record(name, fn);
+  }
+  return fn;
+}
+
 __GLXextFuncPtr glXGetProcAddressARB(const GLubyte *procName)
 {
   return glXGetProcAddress(procName);
 }
 
+static const char extensions[] =
+  "GLX_ARB_get_proc_address GLX_EXT_swap_control GLX_MESA_copy_sub_buffer GLX_MESA_swap_control "
+  "GLX_SGI_swap_control ";
+
 const char *glXGetClientString(Display *dpy, int name)
 {
   switch (name)
   {
     case GLX_VENDOR: return "primus";
     case GLX_VERSION: return "1.4";
-    case GLX_EXTENSIONS: return "GLX_ARB_get_proc_address ";
+    case GLX_EXTENSIONS: return extensions;
     default: return NULL;
   }
 }
 
 const char *glXQueryExtensionsString(Display *dpy, int screen)
 {
-  return "GLX_ARB_get_proc_address ";
+  return extensions;
 }
 
 // OpenGL ABI specifies that anything above OpenGL 1.2 + ARB_multitexture must